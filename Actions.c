@@ -16,6 +16,7 @@
 #include "Externs.h"
 
 #ifdef __cplusplus
+#include "ROMController.hpp"
 #include <cassert>
 #include <cstring>
 #else
@@ -23,54 +24,77 @@
 #include <string.h>
 #endif
 
+
+#ifdef __cplusplus
 /* ============================================================================
- *  PIHandleDMARead: Invoked when PI_RD_LEN_REG is written.
- *
- *  PI_CART_ADDR_REG = Cart (source) address.
- *  PI_DRAM_ADDR_REG = DRAM (target) address.
- *  PI_WR_LEN_REG = Transfer size.
+ *  ExternBus: Binds rom::ROMController to the host's bus externs.
  * ========================================================================= */
-void PIHandleDMARead(struct ROMController *controller) {
-  uint32_t dest = controller->regs[PI_CART_ADDR_REG] & 0xFFFFFFF;
-  uint32_t source = controller->regs[PI_DRAM_ADDR_REG] & 0x7FFFFF;
-  uint32_t length = (controller->regs[PI_RD_LEN_REG] & 0xFFFFFF) + 1;
+namespace {
+struct ExternBus {
+  struct BusController *bus;
 
-  if (controller->regs[PI_DRAM_ADDR_REG] == 0xFFFFFFFF) {
-    controller->regs[PI_STATUS_REG] &= ~0x1;
-    controller->regs[PI_STATUS_REG] |= 0x8;
+  explicit ExternBus(struct BusController *bus) : bus(bus) {}
 
-    BusRaiseRCPInterrupt(controller->bus, MI_INTR_PI);
-    return;
+  void ClearRCPInterrupt(unsigned mask) {
+    BusClearRCPInterrupt(bus, mask);
   }
 
-  if (length & 7)
-    length = (length + 7) & ~7;
+  void RaiseRCPInterrupt(unsigned mask) {
+    BusRaiseRCPInterrupt(bus, mask);
+  }
 
-  if (dest & 0x08000000) {
-    debug("DMA | Request: Write to SRAM.");
-    dest &= 0x7FFF;
+  void DMAFromDRAM(void *dest, uint32_t source, uint32_t length) {
+    ::DMAFromDRAM(bus, dest, source, length);
+  }
 
-    if (dest + length > sizeof(controller->sram)) {
-      length = sizeof(controller->sram) - dest;
+  void DMAToDRAM(uint32_t dest, const void *source, size_t length) {
+    ::DMAToDRAM(bus, dest, source, length);
+  }
+};
+}
 
-      debug("DMA | Copy would overflow SRAM bounds; trimming.");
-    }
+/* ============================================================================
+ *  PIHandleDMARead: Invoked when PI_RD_LEN_REG is written.
+ * ========================================================================= */
+void PIHandleDMARead(struct ROMController *controller) {
+  ExternBus bus(controller->bus);
+  rom::ROMController<ExternBus>(*controller, bus).HandleDMARead();
+}
 
-    debugarg("DMA | DEST   : [0x%.8x].", dest);
-    debugarg("DMA | SOURCE : [0x%.8x].", source);
-    debugarg("DMA | LENGTH : [0x%.8x].", length);
+/* ============================================================================
+ *  PIHandleDMAWrite: Invoked when PI_WR_LEN_REG is written.
+ * ========================================================================= */
+void PIHandleDMAWrite(struct ROMController *controller) {
+  ExternBus bus(controller->bus);
+  rom::ROMController<ExternBus>(*controller, bus).HandleDMAWrite();
+}
 
-    DMAFromDRAM(controller->bus, controller->sram + dest, source, length);
-  }
+/* ============================================================================
+ *  PIHandleStatusWrite: Invoked when PI_STATUS_REG is written.
+ * ========================================================================= */
+void PIHandleStatusWrite(struct ROMController *controller, uint32_t status) {
+  ExternBus bus(controller->bus);
+  rom::ROMController<ExternBus>(*controller, bus).HandleStatusWrite(status);
+}
+
+#else
+/* ============================================================================
+ *  PIHandleDMARead: Invoked when PI_RD_LEN_REG is written.
+ *
+ *  PI_CART_ADDR_REG = Cart (target) address.
+ *  PI_DRAM_ADDR_REG = DRAM (source) address.
+ *  PI_RD_LEN_REG = Transfer size.
+ * ========================================================================= */
+void PIHandleDMARead(struct ROMController *controller) {
+  struct PIDMA dma;
+  uint8_t *data;
 
-  else if (!(dest & 0x06000000)) {
-    debug("DMA | Request: Write to cart; ignoring.");
+  if ((data = PIBeginDMARead(controller, &dma)) != NULL) {
+    if (!PICopyFromRDRAM(controller, data, dma.dram, dma.length))
+      DMAFromDRAM(controller->bus, data, dma.dram, dma.length);
   }
 
-  controller->regs[PI_DRAM_ADDR_REG] += length;
-  controller->regs[PI_CART_ADDR_REG] += length;
-  controller->regs[PI_STATUS_REG] &= ~0x1;
-  controller->regs[PI_STATUS_REG] |= 0x8;
+  PIFinishDMA(controller, dma.length);
 
   BusRaiseRCPInterrupt(controller->bus, MI_INTR_PI);
 }
@@ -83,58 +107,18 @@ void PIHandleDMARead(struct ROMController *controller) {
  *  PI_WR_LEN_REG = Transfer size.
  * ========================================================================= */
 void PIHandleDMAWrite(struct ROMController *controller) {
-  uint32_t dest = controller->regs[PI_DRAM_ADDR_REG] & 0x7FFFFF;
-  uint32_t source = controller->regs[PI_CART_ADDR_REG] & 0xFFFFFFF;
-  uint32_t length = (controller->regs[PI_WR_LEN_REG] & 0xFFFFFF) + 1;
-
-  if (controller->regs[PI_DRAM_ADDR_REG] == 0xFFFFFFFF) {
-    controller->regs[PI_STATUS_REG] &= ~0x1;
-    controller->regs[PI_STATUS_REG] |= 0x8;
-
-    BusRaiseRCPInterrupt(controller->bus, MI_INTR_PI);
-    return;
-  }
-
-  if (length & 7)
-    length = (length + 7) & ~7;
-
-  if (source & 0x08000000) {
-    debug("DMA | Request: Read from SRAM.");
-    source &= 0x7FFF;
+  const uint8_t *data;
+  uint32_t dram, avail;
+  struct PIDMA dma;
 
-    if (source + length > sizeof(controller->sram)) {
-      length = sizeof(controller->sram) - source;
+  PIBeginDMAWrite(controller, &dma);
 
-      debug("DMA | Copy would overflow SRAM bounds; trimming.");
-    }
-
-    debugarg("DMA | DEST   : [0x%.8x].", dest);
-    debugarg("DMA | SOURCE : [0x%.8x].", source);
-    debugarg("DMA | LENGTH : [0x%.8x].", length);
-
-    DMAToDRAM(controller->bus, dest, controller->sram + source, length);
-  }
-
-  else if (!(source & 0x06000000)) {
-    debug("DMA | Request: Read from cart.");
-
-    if (source + length > controller->cart->size) {
-      length = controller->cart->size - source;
-
-      debug("DMA | Copy would overflow cart bounds; trimming.");
-    }
-
-    debugarg("DMA | DEST   : [0x%.8x].", dest);
-    debugarg("DMA | SOURCE : [0x%.8x].", source);
-    debugarg("DMA | LENGTH : [0x%.8x].", length);
-
-    DMAToDRAM(controller->bus, dest, controller->cart->rom + source, length);
+  while ((data = PINextDMASpan(controller, &dma, &dram, &avail)) != NULL) {
+    if (!PICopyToRDRAM(controller, dram, data, avail))
+      DMAToDRAM(controller->bus, dram, data, avail);
   }
 
-  controller->regs[PI_DRAM_ADDR_REG] += length;
-  controller->regs[PI_CART_ADDR_REG] += length;
-  controller->regs[PI_STATUS_REG] &= ~0x1;
-  controller->regs[PI_STATUS_REG] |= 0x8;
+  PIFinishDMA(controller, dma.length);
 
   BusRaiseRCPInterrupt(controller->bus, MI_INTR_PI);
 }
@@ -145,19 +129,19 @@ void PIHandleDMAWrite(struct ROMController *controller) {
  *  [0]: Reset controller.
  *  [1]: Clear interrupt.
  * ========================================================================= */
-void PIHandleStatusWrite(struct ROMController *controller) {
-  uint32_t status = controller->regs[PI_STATUS_REG];
-  bool resetController = status & 1;
-  bool clearInterrupt = status & 2;
+void PIHandleStatusWrite(struct ROMController *controller, uint32_t status) {
+  bool resetController = status & PI_STATUS_RESET;
+  bool clearInterrupt = status & PI_STATUS_CLEAR_INTERRUPT;
 
   if (resetController)
-    controller->regs[PI_STATUS_REG] = 0;
+    AtomicStore32(&controller->regs[PI_STATUS_REG], 0);
 
   if (clearInterrupt) {
     BusClearRCPInterrupt(controller->bus, MI_INTR_PI);
-    controller->regs[PI_STATUS_REG] &= ~0x8;
+    AtomicAnd32(&controller->regs[PI_STATUS_REG], ~PI_STATUS_INTERRUPT);
   }
 }
+#endif
 
 /* ============================================================================
  *  ReadSRAMFile: Reads the contents SRAM file into the controller.
@@ -171,8 +155,8 @@ ReadSRAMFile(struct ROMController *controller) {
 
   rewind(controller->sramFile);
 
-  while (cur < sizeof(controller->sram)) {
-    size_t remaining = sizeof(controller->sram) - cur;
+  while (cur < controller->sramSize) {
+    size_t remaining = controller->sramSize - cur;
     size_t ret;
 
     if ((ret = fread(controller->sram + cur, 1,
@@ -182,7 +166,7 @@ ReadSRAMFile(struct ROMController *controller) {
 
     /* Ignore invalid sized files. */
     if (feof(controller->sramFile)) {
-      memset(controller->sram, 0, sizeof(controller->sram));
+      memset(controller->sram, 0, controller->sramSize);
       printf("SRAM: Ignoring short SRAM file.\n");
       return 0;
     }
@@ -201,6 +185,12 @@ SetSRAMFile(struct ROMController *controller, const char *filename) {
   if (controller->sramFile != NULL)
     fclose(controller->sramFile);
 
+  if (!PIHasSRAM(controller)) {
+    debug("SRAM: Cart does not use SRAM; not opening a save file.");
+    controller->sramFile = NULL;
+    return;
+  }
+
   /* Try opening with rb+ first, then wb+ iff we fail. */
   if ((controller->sramFile = fopen(filename, "rb+")) == NULL) {
     controller->sramFile = fopen(filename, "wb+");
@@ -222,8 +212,8 @@ WriteSRAMFile(struct ROMController *controller) {
 
   rewind(controller->sramFile);
 
-  while (cur < sizeof(controller->sram)) {
-    size_t remaining = sizeof(controller->sram) - cur;
+  while (cur < controller->sramSize) {
+    size_t remaining = controller->sramSize - cur;
     size_t ret;
 
     if ((ret = fwrite(controller->sram + cur, 1,
@@ -10,8 +10,12 @@
  * ========================================================================= */
 #ifndef __ROM__ACTION_H__
 #define __ROM__ACTION_H__
+#include "Cart.h"
 #include "Common.h"
 #include "Controller.h"
+#include "DMACopy.h"
+#include "DebugChannel.h"
+#include "Definitions.h"
 
 #ifdef __cplusplus
 #include <cstddef>
@@ -21,7 +25,347 @@
 
 void PIHandleDMARead(struct ROMController *);
 void PIHandleDMAWrite(struct ROMController *);
-void PIHandleStatusWrite(struct ROMController *);
+void PIHandleStatusWrite(struct ROMController *, uint32_t);
+
+/* ============================================================================
+ *  PICopyFromRDRAM/PICopyToRDRAM: Perform a DMA directly against the host's
+ *  RDRAM, if the host registered it. Return false if the transfer must go
+ *  through the bus instead. Transfers are trimmed to the end of RDRAM.
+ * ========================================================================= */
+static inline bool
+PICopyFromRDRAM(struct ROMController *controller,
+  void *dest, uint32_t source, uint32_t length) {
+  if (controller->rdram == NULL)
+    return false;
+
+  if (source < controller->rdramSize) {
+    if (length > controller->rdramSize - source)
+      length = controller->rdramSize - source;
+
+    DMACopy(dest, controller->rdram + source, length);
+  }
+
+  return true;
+}
+
+static inline bool
+PICopyToRDRAM(struct ROMController *controller,
+  uint32_t dest, const void *source, uint32_t length) {
+  if (controller->rdram == NULL)
+    return false;
+
+  if (dest < controller->rdramSize) {
+    if (length > controller->rdramSize - dest)
+      length = controller->rdramSize - dest;
+
+    DMACopy(controller->rdram + dest, source, length);
+  }
+
+  return true;
+}
+
+/* ============================================================================
+ *  PIIsSRAM/PIIsCart: Decode the (physical) PI_CART_ADDR_REG of a DMA.
+ * ========================================================================= */
+static inline bool
+PIIsSRAM(uint32_t address) {
+  return address - ROM_SRAM_BASE_ADDRESS < ROM_SRAM_ADDRESS_LEN;
+}
+
+static inline bool
+PIIsCart(uint32_t address) {
+  return address - ROM_CART_BASE_ADDRESS < ROM_CART_ADDRESS_LEN;
+}
+
+/* ============================================================================
+ *  PIDebugWindow: Returns where a DMA to the cart should land if it targets
+ *  the debug window (trimming length to the window), or NULL otherwise.
+ * ========================================================================= */
+static inline uint8_t *
+PIDebugWindow(struct ROMController *controller,
+  uint32_t address, uint32_t *length) {
+  uint8_t *window;
+  uint32_t avail;
+
+  if (controller->debugChannel == NULL || !IsDebugWindow(address))
+    return NULL;
+
+  window = GetDebugChannelBuffer(controller->debugChannel, address, &avail);
+
+  if (*length > avail)
+    *length = avail;
+
+  return window;
+}
+
+/* ============================================================================
+ *  PIHasSRAM: Returns true if domain 2 is backed by SRAM. Carts that save to
+ *  EEPROM go through the PIF instead, and FlashRAM is not yet emulated.
+ * ========================================================================= */
+static inline bool
+PIHasSRAM(const struct ROMController *controller) {
+  return controller->sram != NULL;
+}
+
+/* ============================================================================
+ *  PISRAMWindow: Returns where a DMA to or from domain 2 lands in SRAM
+ *  (trimming length to it). Banked SRAM puts each 32KiB bank at the start
+ *  of its own 256KiB slot; otherwise SRAM mirrors across the domain.
+ * ========================================================================= */
+static inline uint8_t *
+PISRAMWindow(struct ROMController *controller,
+  uint32_t address, uint32_t *length) {
+  uint32_t offset;
+
+  if (controller->cart && controller->cart->saveType == SAVE_TYPE_SRAM_768K)
+    offset = (address >> 18 & 0x3) << 15 | (address & 0x7FFF);
+  else
+    offset = address & (controller->sramSize - 1);
+
+  if (offset >= controller->sramSize)
+    *length = 0;
+
+  else if (*length > controller->sramSize - offset)
+    *length = controller->sramSize - offset;
+
+  return controller->sram + offset;
+}
+
+/* ============================================================================
+ *  PIStartDMA: Marks the controller busy for the duration of a DMA.
+ * ========================================================================= */
+static inline void
+PIStartDMA(struct ROMController *controller) {
+  AtomicOr32(&controller->regs[PI_STATUS_REG], PI_STATUS_DMA_BUSY);
+}
+
+/* ============================================================================
+ *  PIFinishDMA: Advances the address registers, then clears the busy bit
+ *  and flags the interrupt in one step. The release ordering guarantees
+ *  that a thread which observes the DMA as finished also observes the data
+ *  and the updated registers. Only the CPU thread writes the address
+ *  registers, so they do not need a read-modify-write.
+ * ========================================================================= */
+static inline void
+PIFinishDMA(struct ROMController *controller, uint32_t length) {
+  uint32_t *regs = controller->regs;
+  uint32_t status = AtomicLoad32(&regs[PI_STATUS_REG]);
+
+  AtomicStore32(&regs[PI_DRAM_ADDR_REG],
+    AtomicLoad32(&regs[PI_DRAM_ADDR_REG]) + length);
+  AtomicStore32(&regs[PI_CART_ADDR_REG],
+    AtomicLoad32(&regs[PI_CART_ADDR_REG]) + length);
+
+  while (!AtomicCAS32(&regs[PI_STATUS_REG], &status,
+    (status & ~PI_STATUS_DMA_BUSY) | PI_STATUS_INTERRUPT));
+}
+
+/* ============================================================================
+ *  PIDMA: A DMA, decoded from the registers by PIBeginDMARead or
+ *  PIBeginDMAWrite. The handlers (C and rom::ROMController alike) only move
+ *  the data: everything else about a DMA is decided here.
+ * ========================================================================= */
+enum PIDMATarget {
+  PI_DMA_IGNORE,
+  PI_DMA_DEBUG,
+  PI_DMA_SRAM,
+  PI_DMA_CART
+};
+
+struct PIDMA {
+  enum PIDMATarget target;
+  uint32_t dram;      /* RDRAM address of the next span. */
+  uint32_t address;   /* Physical PI address of the next span. */
+  uint32_t length;    /* Length of the DMA, once trimmed. */
+  uint32_t remaining; /* Bytes not yet copied. */
+};
+
+/* ============================================================================
+ *  PIBeginDMA: Decodes the registers common to both directions. Returns
+ *  false (with a zero length) for the RDRAM address that cancels a DMA;
+ *  otherwise, marks the controller busy.
+ * ========================================================================= */
+static inline bool
+PIBeginDMA(struct ROMController *controller, struct PIDMA *dma,
+  enum PIRegister lengthReg) {
+  uint32_t *regs = controller->regs;
+  uint32_t dram = AtomicLoad32(&regs[PI_DRAM_ADDR_REG]);
+
+  dma->target = PI_DMA_IGNORE;
+  dma->dram = dram & 0x7FFFFF;
+  dma->address = AtomicLoad32(&regs[PI_CART_ADDR_REG]) & 0x1FFFFFFF;
+  dma->length = (AtomicLoad32(&regs[lengthReg]) & 0xFFFFFF) + 1;
+
+  if (dram == 0xFFFFFFFF) {
+    dma->length = dma->remaining = 0;
+    return false;
+  }
+
+  PIStartDMA(controller);
+
+  if (dma->length & 7)
+    dma->length = (dma->length + 7) & ~7;
+
+  return true;
+}
+
+/* ============================================================================
+ *  PITraceDMA: Prints a DMA once its target is known (debug builds only).
+ * ========================================================================= */
+static inline void
+PITraceDMA(const struct PIDMA *dma) {
+  debugarg("DMA | DRAM   : [0x%.8x].", dma->dram);
+  debugarg("DMA | PI     : [0x%.8x].", dma->address);
+  debugarg("DMA | LENGTH : [0x%.8x].", dma->length);
+
+  (void) dma;
+}
+
+/* ============================================================================
+ *  PIBeginDMARead: Decodes a DMA from RDRAM (PI_RD_LEN_REG). Returns where
+ *  the data lands, with dma->length trimmed to fit; or NULL if it is to be
+ *  dropped.
+ * ========================================================================= */
+static inline uint8_t *
+PIBeginDMARead(struct ROMController *controller, struct PIDMA *dma) {
+  struct Cart *cart = controller->cart;
+  uint8_t *data;
+
+  if (!PIBeginDMA(controller, dma, PI_RD_LEN_REG))
+    return NULL;
+
+  if ((data = PIDebugWindow(controller,
+    dma->address, &dma->length)) != NULL) {
+    debug("DMA | Request: Write to debug window.");
+    dma->target = PI_DMA_DEBUG;
+  }
+
+  else if (PIIsSRAM(dma->address) && !PIHasSRAM(controller)) {
+    debug("DMA | Request: Write to domain 2 without SRAM; ignoring.");
+  }
+
+  else if (PIIsSRAM(dma->address)) {
+    debug("DMA | Request: Write to SRAM.");
+    data = PISRAMWindow(controller, dma->address, &dma->length);
+    dma->target = PI_DMA_SRAM;
+  }
+
+  else if (PIIsCart(dma->address) && cart && cart->writable) {
+    debug("DMA | Request: Write to cart.");
+    data = CartLookupWritable(cart, dma->address - ROM_CART_BASE_ADDRESS,
+      dma->length, &dma->length);
+    dma->target = PI_DMA_CART;
+  }
+
+  else if (PIIsCart(dma->address)) {
+    debug("DMA | Request: Write to cart; ignoring.");
+  }
+
+  dma->remaining = data != NULL ? dma->length : 0;
+  PITraceDMA(dma);
+  return data;
+}
+
+/* ============================================================================
+ *  PIBeginDMAWrite: Decodes a DMA to RDRAM (PI_WR_LEN_REG), trimming
+ *  dma->length to what the source holds. Use PINextDMASpan to walk it.
+ * ========================================================================= */
+static inline void
+PIBeginDMAWrite(struct ROMController *controller, struct PIDMA *dma) {
+  uint32_t offset, span;
+
+  if (!PIBeginDMA(controller, dma, PI_WR_LEN_REG))
+    return;
+
+  if (PIIsSRAM(dma->address) && !PIHasSRAM(controller)) {
+    debug("DMA | Request: Read from domain 2 without SRAM; ignoring.");
+  }
+
+  else if (PIIsSRAM(dma->address)) {
+    debug("DMA | Request: Read from SRAM.");
+    PISRAMWindow(controller, dma->address, &dma->length);
+    dma->target = PI_DMA_SRAM;
+  }
+
+  else if (PIIsCart(dma->address)) {
+    debug("DMA | Request: Read from cart.");
+    offset = dma->address - ROM_CART_BASE_ADDRESS;
+    span = CartSpan(controller->cart);
+
+    if (offset >= span || dma->length > span - offset) {
+      dma->length = offset < span ? span - offset : 0;
+
+      debug("DMA | Copy would overflow cart bounds; trimming.");
+    }
+
+    dma->target = PI_DMA_CART;
+  }
+
+  dma->remaining = dma->target != PI_DMA_IGNORE ? dma->length : 0;
+  PITraceDMA(dma);
+}
+
+/* ============================================================================
+ *  PINextDMASpan: Returns the next contiguous piece of a DMA to RDRAM and
+ *  its length, advancing the DMA past it; or NULL once it is done. Cached
+ *  carts are only contiguous within a block. dram receives where it goes.
+ * ========================================================================= */
+static inline const uint8_t *
+PINextDMASpan(struct ROMController *controller, struct PIDMA *dma,
+  uint32_t *dram, uint32_t *avail) {
+  const uint8_t *data;
+
+  if (dma->remaining == 0)
+    return NULL;
+
+  if (dma->target == PI_DMA_SRAM) {
+    data = PISRAMWindow(controller, dma->address, &dma->remaining);
+    *avail = dma->remaining;
+  }
+
+  else if ((data = CartLookup(controller->cart,
+    dma->address - ROM_CART_BASE_ADDRESS, avail)) == NULL)
+    return NULL;
+
+  if (*avail > dma->remaining)
+    *avail = dma->remaining;
+
+  *dram = dma->dram;
+  dma->dram += *avail;
+  dma->address += *avail;
+  dma->remaining -= *avail;
+  return data;
+}
+
+/* ============================================================================
+ *  PIWriteRegister: Writes a PI register and performs whatever action the
+ *  write triggers.
+ * ========================================================================= */
+static inline void
+PIWriteRegister(struct ROMController *controller,
+  enum PIRegister reg, uint32_t value) {
+  /* Status writes are commands; they never land in the register. */
+  if (reg != PI_STATUS_REG)
+    AtomicStore32(&controller->regs[reg], value);
+
+  /* Action? */
+  switch(reg) {
+    case PI_STATUS_REG:
+      PIHandleStatusWrite(controller, value);
+      break;
+
+    case PI_RD_LEN_REG:
+      PIHandleDMARead(controller);
+      break;
+
+    case PI_WR_LEN_REG:
+      PIHandleDMAWrite(controller);
+      break;
+
+    default:
+      break;
+  }
+}
 
 int ReadSRAMFile(struct ROMController *);
 void SetSRAMFile(struct ROMController *, const char *);
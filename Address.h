@@ -15,9 +15,17 @@
 #define PI_REGS_BASE_ADDRESS      0x04600000
 #define PI_REGS_ADDRESS_LEN       0x00000034
 
+/* Cartridge SRAM (domain 2); sized by save type (see PISRAMWindow). */
+#define ROM_SRAM_BASE_ADDRESS     0x08000000
+#define ROM_SRAM_ADDRESS_LEN      0x08000000
+
 /* ROM Cartridge Interface. */
 #define ROM_CART_BASE_ADDRESS     0x10000000
 #define ROM_CART_ADDRESS_LEN      0x0FC00000
 
+/* Development cart (IS-Viewer) debug window, within cart space. */
+#define DEBUG_WINDOW_BASE_ADDRESS 0x13FF0000
+#define DEBUG_WINDOW_ADDRESS_LEN  0x00010000
+
 #endif
 
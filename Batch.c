@@ -0,0 +1,233 @@
+/* ============================================================================
+ *  Batch.c: Lockstep batches of ROM controllers.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "Actions.h"
+#include "Batch.h"
+#include "Cart.h"
+#include "Common.h"
+#include "Controller.h"
+#include "Definitions.h"
+#include "Externs.h"
+
+#ifdef __cplusplus
+#include <cstdlib>
+#include <cstring>
+#else
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+/* ============================================================================
+ *  A batch is a fixed set of controllers that are stepped in lockstep, and
+ *  that usually have the same cart image inserted; DMAs are only shared
+ *  between carts for which CartsMatch holds. Per-controller state needed
+ *  to group DMAs is decoded into flat arrays (structure of arrays), so
+ *  grouping is a scan rather than a pointer chase per comparison.
+ * ========================================================================= */
+struct ROMBatch {
+  struct ROMController **controllers;
+  unsigned count;
+
+  const struct Cart **carts;
+  uint32_t *source;
+  uint32_t *dest;
+  uint32_t *length;
+  uint32_t *members;
+  bool *pending;
+};
+
+static void BatchDMAWrite(struct ROMBatch *);
+static void GroupDMAWrite(struct ROMBatch *, unsigned, uint32_t, uint32_t);
+
+/* ============================================================================
+ *  CreateROMBatch: Creates a batch over count controllers. The controllers
+ *  remain owned by the caller and must outlive the batch.
+ * ========================================================================= */
+struct ROMBatch *
+CreateROMBatch(struct ROMController *const *controllers, unsigned count) {
+  struct ROMBatch *batch;
+
+  if ((batch = (struct ROMBatch*) calloc(1, sizeof(*batch))) == NULL) {
+    debug("Failed to allocate memory for the batch.");
+    return NULL;
+  }
+
+  batch->controllers = (struct ROMController**) malloc(
+    count * sizeof(*batch->controllers));
+  batch->carts = (const struct Cart**) malloc(count * sizeof(*batch->carts));
+  batch->source = (uint32_t*) malloc(count * sizeof(*batch->source));
+  batch->dest = (uint32_t*) malloc(count * sizeof(*batch->dest));
+  batch->length = (uint32_t*) malloc(count * sizeof(*batch->length));
+  batch->members = (uint32_t*) malloc(count * sizeof(*batch->members));
+  batch->pending = (bool*) malloc(count * sizeof(*batch->pending));
+
+  if (!batch->controllers || !batch->carts || !batch->source ||
+    !batch->dest || !batch->length || !batch->members || !batch->pending) {
+    debug("Failed to allocate memory for the batch.");
+
+    DestroyROMBatch(batch);
+    return NULL;
+  }
+
+  memcpy(batch->controllers, controllers, count * sizeof(*controllers));
+  batch->count = count;
+  return batch;
+}
+
+/* ============================================================================
+ *  DestroyROMBatch: Releases a batch (but not its controllers).
+ * ========================================================================= */
+void
+DestroyROMBatch(struct ROMBatch *batch) {
+  free(batch->pending);
+  free(batch->members);
+  free(batch->length);
+  free(batch->dest);
+  free(batch->source);
+  free(batch->carts);
+  free(batch->controllers);
+  free(batch);
+}
+
+/* ============================================================================
+ *  PIRegWriteBatch: Applies a sequence of register writes to every
+ *  controller in the batch, in order; the result is the same as issuing
+ *  each write to each controller with PIRegWrite.
+ * ========================================================================= */
+void
+PIRegWriteBatch(struct ROMBatch *batch,
+  const struct PIBatchWrite *writes, unsigned numWrites) {
+  unsigned i, j;
+
+  for (i = 0; i < numWrites; i++) {
+    const struct PIBatchWrite *write = writes + i;
+
+    if (write->reg == PI_WR_LEN_REG) {
+      for (j = 0; j < batch->count; j++) {
+        AtomicStore32(&batch->controllers[j]->regs[PI_WR_LEN_REG],
+          write->values ? write->values[j] : write->value);
+      }
+
+      BatchDMAWrite(batch);
+      continue;
+    }
+
+    for (j = 0; j < batch->count; j++) {
+      PIWriteRegister(batch->controllers[j], write->reg,
+        write->values ? write->values[j] : write->value);
+    }
+  }
+}
+
+/* ============================================================================
+ *  BatchDMAWrite: Performs the DMA each controller was just asked for.
+ *  Cart-to-DRAM DMAs of the same range of the same image, mapped over the
+ *  same span (see CartSpan), are performed as a group; anything else goes
+ *  through PIHandleDMAWrite as usual.
+ * ========================================================================= */
+static void
+BatchDMAWrite(struct ROMBatch *batch) {
+  unsigned i, j;
+
+  for (i = 0; i < batch->count; i++) {
+    struct ROMController *controller = batch->controllers[i];
+    uint32_t *regs = controller->regs;
+    uint32_t dram = AtomicLoad32(&regs[PI_DRAM_ADDR_REG]);
+    uint32_t cart = AtomicLoad32(&regs[PI_CART_ADDR_REG]) & 0x1FFFFFFF;
+
+    batch->carts[i] = controller->cart;
+    batch->source[i] = cart - ROM_CART_BASE_ADDRESS;
+    batch->dest[i] = dram & 0x7FFFFF;
+    batch->length[i] = (AtomicLoad32(&regs[PI_WR_LEN_REG]) & 0xFFFFFF) + 1;
+    /* Writable carts each have a private copy; never share their DMAs. */
+    batch->pending[i] = controller->cart != NULL &&
+      !controller->cart->writable && dram != 0xFFFFFFFF && PIIsCart(cart);
+
+    if (!batch->pending[i])
+      PIHandleDMAWrite(controller);
+  }
+
+  for (i = 0; i < batch->count; i++) {
+    const struct Cart *cart = batch->carts[i];
+    uint32_t source = batch->source[i];
+    uint32_t length = batch->length[i];
+    unsigned count = 0;
+
+    if (!batch->pending[i])
+      continue;
+
+    for (j = i; j < batch->count; j++) {
+      if (batch->pending[j] && batch->source[j] == source &&
+        batch->length[j] == length && CartsMatch(batch->carts[j], cart) &&
+        CartSpan(batch->carts[j]) == CartSpan(cart)) {
+        batch->members[count++] = j;
+        batch->pending[j] = false;
+      }
+    }
+
+    GroupDMAWrite(batch, count, source, length);
+  }
+}
+
+/* ============================================================================
+ *  GroupDMAWrite: Copies one range of the cart to the DRAM of every member
+ *  of a group. The range is read once, a chunk at a time, and each chunk
+ *  is copied to every member while it is still in the host's cache.
+ * ========================================================================= */
+static void
+GroupDMAWrite(struct ROMBatch *batch,
+  unsigned count, uint32_t source, uint32_t length) {
+  struct Cart *cart = batch->controllers[batch->members[0]]->cart;
+  uint32_t span = CartSpan(cart);
+  uint32_t offset = 0;
+  unsigned i;
+
+  for (i = 0; i < count; i++)
+    PIStartDMA(batch->controllers[batch->members[i]]);
+
+  if (length & 7)
+    length = (length + 7) & ~7;
+
+  if (source >= span || length > span - source)
+    length = source < span ? span - source : 0;
+
+  while (offset < length) {
+    const uint8_t *rom;
+    uint32_t avail;
+
+    if ((rom = CartLookup(cart, source + offset, &avail)) == NULL)
+      break;
+
+    if (avail > length - offset)
+      avail = length - offset;
+
+    if (avail > ROM_BATCH_DMA_CHUNK)
+      avail = ROM_BATCH_DMA_CHUNK;
+
+    for (i = 0; i < count; i++) {
+      unsigned member = batch->members[i];
+      struct ROMController *controller = batch->controllers[member];
+      uint32_t dest = batch->dest[member] + offset;
+
+      if (!PICopyToRDRAM(controller, dest, rom, avail))
+        DMAToDRAM(controller->bus, dest, rom, avail);
+    }
+
+    offset += avail;
+  }
+
+  for (i = 0; i < count; i++) {
+    struct ROMController *controller = batch->controllers[batch->members[i]];
+
+    PIFinishDMA(controller, length);
+    BusRaiseRCPInterrupt(controller->bus, MI_INTR_PI);
+  }
+}
+
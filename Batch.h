@@ -0,0 +1,39 @@
+/* ============================================================================
+ *  Batch.h: Lockstep batches of ROM controllers.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#ifndef __ROM__BATCH_H__
+#define __ROM__BATCH_H__
+#include "Common.h"
+#include "Controller.h"
+
+/* DMAs shared by a group are copied out this much at a time. */
+#define ROM_BATCH_DMA_CHUNK       0x8000
+
+/* ============================================================================
+ *  PIBatchWrite: One register write, applied to every controller in the
+ *  batch. values holds one value per controller, in batch order; if it is
+ *  NULL, value is written to all of them.
+ * ========================================================================= */
+struct PIBatchWrite {
+  enum PIRegister reg;
+  const uint32_t *values;
+  uint32_t value;
+};
+
+struct ROMBatch;
+
+struct ROMBatch *CreateROMBatch(struct ROMController *const *, unsigned);
+void DestroyROMBatch(struct ROMBatch *);
+
+void PIRegWriteBatch(struct ROMBatch *, const struct PIBatchWrite *,
+  unsigned);
+
+#endif
+
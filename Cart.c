@@ -8,10 +8,17 @@
  *  This file is subject to the terms and conditions defined in
  *  file 'LICENSE', which is part of this source code package.
  * ========================================================================= */
+#if (defined(MMAP_ROM_IMAGE) || defined(__linux__)) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "Address.h"
 #include "Cart.h"
+#include "CartCache.h"
 #include "Controller.h"
+#include "DebugChannel.h"
 #include "Externs.h"
+#include "Loader.h"
 
 #ifdef __cplusplus
 #include <cstddef>
@@ -25,8 +32,15 @@
 #include <string.h>
 #endif
 
-#ifdef MMAP_ROM_IMAGE
+#if defined(MMAP_ROM_IMAGE) || defined(__linux__)
 #include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(CACHED_ROM_IMAGE) || defined(SHARED_ROM_IMAGE)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #define CRC_CIC_NUS_6101 0x6170A4A1
@@ -43,46 +57,462 @@ enum CICSEED {
   SEED_CIC_NUS_6106 = 0x0000853F
 };
 
+/* ============================================================================
+ *  Save hardware, by the two-character game code in the header. Carts that
+ *  are not listed (unlisted releases, hacks with a changed code, homebrew
+ *  without the "ED" code) keep the old default of SRAM, so that a save is
+ *  never silently dropped; they merely get a buffer they may not use.
+ * ========================================================================= */
+struct CartSaveEntry {
+  char id[2];
+  enum CartSaveType saveType;
+};
+
+static const struct CartSaveEntry CartSaveTable[] = {
+  /* 4Kbit EEPROM. */
+  {{'A', 'B'}, SAVE_TYPE_EEPROM_4K},
+  {{'A', 'D'}, SAVE_TYPE_EEPROM_4K},
+  {{'A', 'G'}, SAVE_TYPE_EEPROM_4K},
+  {{'B', 'C'}, SAVE_TYPE_EEPROM_4K},
+  {{'B', 'D'}, SAVE_TYPE_EEPROM_4K},
+  {{'B', 'H'}, SAVE_TYPE_EEPROM_4K},
+  {{'B', 'K'}, SAVE_TYPE_EEPROM_4K},
+  {{'B', 'M'}, SAVE_TYPE_EEPROM_4K},
+  {{'B', 'N'}, SAVE_TYPE_EEPROM_4K},
+  {{'B', 'V'}, SAVE_TYPE_EEPROM_4K},
+  {{'B', '6'}, SAVE_TYPE_EEPROM_4K},
+  {{'C', 'G'}, SAVE_TYPE_EEPROM_4K},
+  {{'C', 'H'}, SAVE_TYPE_EEPROM_4K},
+  {{'C', 'R'}, SAVE_TYPE_EEPROM_4K},
+  {{'C', 'T'}, SAVE_TYPE_EEPROM_4K},
+  {{'C', 'U'}, SAVE_TYPE_EEPROM_4K},
+  {{'C', 'X'}, SAVE_TYPE_EEPROM_4K},
+  {{'D', 'R'}, SAVE_TYPE_EEPROM_4K},
+  {{'D', 'Q'}, SAVE_TYPE_EEPROM_4K},
+  {{'D', 'U'}, SAVE_TYPE_EEPROM_4K},
+  {{'D', 'Y'}, SAVE_TYPE_EEPROM_4K},
+  {{'D', '3'}, SAVE_TYPE_EEPROM_4K},
+  {{'D', '4'}, SAVE_TYPE_EEPROM_4K},
+  {{'E', 'A'}, SAVE_TYPE_EEPROM_4K},
+  {{'E', 'R'}, SAVE_TYPE_EEPROM_4K},
+  {{'F', 'G'}, SAVE_TYPE_EEPROM_4K},
+  {{'F', 'H'}, SAVE_TYPE_EEPROM_4K},
+  {{'F', 'W'}, SAVE_TYPE_EEPROM_4K},
+  {{'F', 'X'}, SAVE_TYPE_EEPROM_4K},
+  {{'F', 'Y'}, SAVE_TYPE_EEPROM_4K},
+  {{'G', 'C'}, SAVE_TYPE_EEPROM_4K},
+  {{'G', 'E'}, SAVE_TYPE_EEPROM_4K},
+  {{'G', 'F'}, SAVE_TYPE_EEPROM_4K},
+  {{'G', 'U'}, SAVE_TYPE_EEPROM_4K},
+  {{'G', 'V'}, SAVE_TYPE_EEPROM_4K},
+  {{'H', 'A'}, SAVE_TYPE_EEPROM_4K},
+  {{'H', 'F'}, SAVE_TYPE_EEPROM_4K},
+  {{'H', 'P'}, SAVE_TYPE_EEPROM_4K},
+  {{'I', 'C'}, SAVE_TYPE_EEPROM_4K},
+  {{'I', 'J'}, SAVE_TYPE_EEPROM_4K},
+  {{'I', 'R'}, SAVE_TYPE_EEPROM_4K},
+  {{'J', 'M'}, SAVE_TYPE_EEPROM_4K},
+  {{'K', '2'}, SAVE_TYPE_EEPROM_4K},
+  {{'K', 'A'}, SAVE_TYPE_EEPROM_4K},
+  {{'K', 'I'}, SAVE_TYPE_EEPROM_4K},
+  {{'K', 'T'}, SAVE_TYPE_EEPROM_4K},
+  {{'L', 'B'}, SAVE_TYPE_EEPROM_4K},
+  {{'L', 'R'}, SAVE_TYPE_EEPROM_4K},
+  {{'M', 'G'}, SAVE_TYPE_EEPROM_4K},
+  {{'M', 'I'}, SAVE_TYPE_EEPROM_4K},
+  {{'M', 'L'}, SAVE_TYPE_EEPROM_4K},
+  {{'M', 'O'}, SAVE_TYPE_EEPROM_4K},
+  {{'M', 'R'}, SAVE_TYPE_EEPROM_4K},
+  {{'M', 'S'}, SAVE_TYPE_EEPROM_4K},
+  {{'M', 'U'}, SAVE_TYPE_EEPROM_4K},
+  {{'M', 'W'}, SAVE_TYPE_EEPROM_4K},
+  {{'N', '6'}, SAVE_TYPE_EEPROM_4K},
+  {{'N', 'A'}, SAVE_TYPE_EEPROM_4K},
+  {{'O', 'H'}, SAVE_TYPE_EEPROM_4K},
+  {{'P', 'G'}, SAVE_TYPE_EEPROM_4K},
+  {{'P', 'W'}, SAVE_TYPE_EEPROM_4K},
+  {{'P', 'Y'}, SAVE_TYPE_EEPROM_4K},
+  {{'R', 'C'}, SAVE_TYPE_EEPROM_4K},
+  {{'R', 'S'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', '6'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'A'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'C'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'M'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'U'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'V'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'W'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', '6'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', 'B'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', 'C'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', 'J'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', 'M'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', 'N'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', 'P'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', 'R'}, SAVE_TYPE_EEPROM_4K},
+  {{'T', 'X'}, SAVE_TYPE_EEPROM_4K},
+  {{'V', 'L'}, SAVE_TYPE_EEPROM_4K},
+  {{'V', 'Y'}, SAVE_TYPE_EEPROM_4K},
+  {{'W', 'C'}, SAVE_TYPE_EEPROM_4K},
+  {{'W', 'L'}, SAVE_TYPE_EEPROM_4K},
+  {{'W', 'Q'}, SAVE_TYPE_EEPROM_4K},
+  {{'W', 'R'}, SAVE_TYPE_EEPROM_4K},
+  {{'W', 'U'}, SAVE_TYPE_EEPROM_4K},
+  {{'X', 'O'}, SAVE_TYPE_EEPROM_4K},
+  {{'4', 'W'}, SAVE_TYPE_EEPROM_4K},
+  {{'G', 'L'}, SAVE_TYPE_EEPROM_4K},
+  {{'O', '2'}, SAVE_TYPE_EEPROM_4K},
+  {{'O', 'S'}, SAVE_TYPE_EEPROM_4K},
+  {{'P', 'M'}, SAVE_TYPE_EEPROM_4K},
+  {{'P', 'T'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'N'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'B'}, SAVE_TYPE_EEPROM_4K},
+  {{'S', 'S'}, SAVE_TYPE_EEPROM_4K},
+
+  /* 16Kbit EEPROM. */
+  {{'B', '7'}, SAVE_TYPE_EEPROM_16K},
+  {{'C', 'W'}, SAVE_TYPE_EEPROM_16K},
+  {{'C', 'Z'}, SAVE_TYPE_EEPROM_16K},
+  {{'D', '6'}, SAVE_TYPE_EEPROM_16K},
+  {{'D', 'O'}, SAVE_TYPE_EEPROM_16K},
+  {{'D', '2'}, SAVE_TYPE_EEPROM_16K},
+  {{'3', 'D'}, SAVE_TYPE_EEPROM_16K},
+  {{'E', 'P'}, SAVE_TYPE_EEPROM_16K},
+  {{'E', 'V'}, SAVE_TYPE_EEPROM_16K},
+  {{'F', '2'}, SAVE_TYPE_EEPROM_16K},
+  {{'F', 'U'}, SAVE_TYPE_EEPROM_16K},
+  {{'I', 'M'}, SAVE_TYPE_EEPROM_16K},
+  {{'K', '4'}, SAVE_TYPE_EEPROM_16K},
+  {{'M', '8'}, SAVE_TYPE_EEPROM_16K},
+  {{'M', 'V'}, SAVE_TYPE_EEPROM_16K},
+  {{'M', 'X'}, SAVE_TYPE_EEPROM_16K},
+  {{'N', 'B'}, SAVE_TYPE_EEPROM_16K},
+  {{'N', 'X'}, SAVE_TYPE_EEPROM_16K},
+  {{'P', 'D'}, SAVE_TYPE_EEPROM_16K},
+  {{'R', 'Z'}, SAVE_TYPE_EEPROM_16K},
+  {{'U', 'B'}, SAVE_TYPE_EEPROM_16K},
+  {{'X', '7'}, SAVE_TYPE_EEPROM_16K},
+  {{'Y', 'S'}, SAVE_TYPE_EEPROM_16K},
+
+  /* 256Kbit SRAM. */
+  {{'A', 'L'}, SAVE_TYPE_SRAM},
+  {{'A', 'Y'}, SAVE_TYPE_SRAM},
+  {{'A', '2'}, SAVE_TYPE_SRAM},
+  {{'D', 'A'}, SAVE_TYPE_SRAM},
+  {{'F', 'Z'}, SAVE_TYPE_SRAM},
+  {{'G', 'P'}, SAVE_TYPE_SRAM},
+  {{'G', '6'}, SAVE_TYPE_SRAM},
+  {{'K', 'G'}, SAVE_TYPE_SRAM},
+  {{'M', 'F'}, SAVE_TYPE_SRAM},
+  {{'O', 'B'}, SAVE_TYPE_SRAM},
+  {{'R', 'E'}, SAVE_TYPE_SRAM},
+  {{'R', 'I'}, SAVE_TYPE_SRAM},
+  {{'T', 'E'}, SAVE_TYPE_SRAM},
+  {{'V', 'B'}, SAVE_TYPE_SRAM},
+  {{'V', 'P'}, SAVE_TYPE_SRAM},
+  {{'W', '2'}, SAVE_TYPE_SRAM},
+  {{'W', 'X'}, SAVE_TYPE_SRAM},
+  {{'W', 'Z'}, SAVE_TYPE_SRAM},
+  {{'Y', 'W'}, SAVE_TYPE_SRAM},
+  {{'Z', 'L'}, SAVE_TYPE_SRAM},
+  {{'B', '5'}, SAVE_TYPE_SRAM},
+  {{'I', 'B'}, SAVE_TYPE_SRAM},
+  {{'P', 'S'}, SAVE_TYPE_SRAM},
+
+  /* 768Kbit (banked) SRAM. */
+  {{'D', 'Z'}, SAVE_TYPE_SRAM_768K},
+
+  /* 1Mbit FlashRAM. */
+  {{'A', 'F'}, SAVE_TYPE_FLASHRAM},
+  {{'C', 'C'}, SAVE_TYPE_FLASHRAM},
+  {{'C', 'K'}, SAVE_TYPE_FLASHRAM},
+  {{'D', 'L'}, SAVE_TYPE_FLASHRAM},
+  {{'D', 'P'}, SAVE_TYPE_FLASHRAM},
+  {{'J', 'D'}, SAVE_TYPE_FLASHRAM},
+  {{'J', 'F'}, SAVE_TYPE_FLASHRAM},
+  {{'K', 'J'}, SAVE_TYPE_FLASHRAM},
+  {{'M', '6'}, SAVE_TYPE_FLASHRAM},
+  {{'M', 'Q'}, SAVE_TYPE_FLASHRAM},
+  {{'P', '2'}, SAVE_TYPE_FLASHRAM},
+  {{'P', '3'}, SAVE_TYPE_FLASHRAM},
+  {{'P', 'F'}, SAVE_TYPE_FLASHRAM},
+  {{'P', 'H'}, SAVE_TYPE_FLASHRAM},
+  {{'P', 'N'}, SAVE_TYPE_FLASHRAM},
+  {{'P', 'O'}, SAVE_TYPE_FLASHRAM},
+  {{'R', 'H'}, SAVE_TYPE_FLASHRAM},
+  {{'S', 'I'}, SAVE_TYPE_FLASHRAM},
+  {{'S', 'Q'}, SAVE_TYPE_FLASHRAM},
+  {{'T', '9'}, SAVE_TYPE_FLASHRAM},
+  {{'W', '4'}, SAVE_TYPE_FLASHRAM},
+  {{'Z', 'S'}, SAVE_TYPE_FLASHRAM},
+};
+
+static void CartCopy(struct Cart *, void *, uint32_t, size_t);
 static uint32_t CRC32(const uint8_t *, size_t);
-static void InitCart(struct Cart *, FILE *, const uint8_t *, size_t);
+static enum CartSaveType DetectSaveType(struct Cart *);
+static void IdentifyCart(struct Cart *, int);
+static void MarkCartPages(uint32_t *, uint32_t, uint32_t);
 
-#ifndef MMAP_ROM_IMAGE
-static int SafeFRead(uint8_t *memory, size_t size, FILE *file);
+#ifdef MMAP_ROM_IMAGE
+static uint8_t *MapCartImage(int, size_t, bool, bool *);
+static uint8_t *MapCartWindow(int, size_t, bool);
+#else
+static uint8_t *LoadCartImage(const char *, size_t,
+  const struct ROMLoadOptions *, struct ROMStream **);
 #endif
+static void InitCart(struct Cart *, FILE *, const uint8_t *, size_t);
+static uint8_t *ImageRange(struct Cart *, uint32_t, uint32_t);
+static size_t ResidentSize(const void *, size_t);
+
+static int CartReadWindow(struct ROMController *, uint32_t, uint32_t *);
+static int CartReadImage(struct ROMController *, uint32_t, uint32_t *);
+static int CartReadDebug(struct ROMController *, uint32_t, uint32_t *);
+
 
 /* ============================================================================
- *  CartRead: Read from Cart.
+ *  CartRead: Read from Cart, through the handler SetCartReadHandler picked.
  * ========================================================================= */
 int
 CartRead(void *_controller, uint32_t address, void *_data) {
-	struct Cart *cart = ((struct ROMController*) _controller)->cart;
+	struct ROMController *controller = (struct ROMController*) _controller;
 	uint32_t *data = (uint32_t*) _data;
+
+  return controller->cartRead(controller, address, data);
+}
+
+/* ============================================================================
+ *  CartReadWindow: Reads a cart mapped over all of cart space; the bus only
+ *  routes cart space here, so there is nothing to check.
+ * ========================================================================= */
+static int
+CartReadWindow(struct ROMController *controller,
+  uint32_t address, uint32_t *data) {
+  uint32_t word;
+
+  memcpy(&word, controller->cart->rom +
+    (address - ROM_CART_BASE_ADDRESS), sizeof(word));
+
+  *data = ByteOrderSwap32(word);
+  return 0;
+}
+
+/* ============================================================================
+ *  CartReadImage: Reads a cart held only up to its size (or not at all).
+ * ========================================================================= */
+static int
+CartReadImage(struct ROMController *controller,
+  uint32_t address, uint32_t *data) {
+  struct Cart *cart = controller->cart;
+  const uint8_t *rom;
   uint32_t word;
 
   address = address - ROM_CART_BASE_ADDRESS;
 
-  if (address > cart->size) {
+  if (cart == NULL || address >= cart->size) {
     debugarg("CartRead: Read beyond cart boundary [0x%.8x]", address);
+
+    *data = 0;
     return 0;
   }
 
-  memcpy(&word, cart->rom + address, sizeof(word));
+#ifdef CACHED_ROM_IMAGE
+  if (cart->cache != NULL)
+    rom = CartCacheLookup(cart->cache, address, NULL);
+  else
+#endif
+  rom = cart->rom + address;
+
+#ifdef PARALLEL_ROM_LOADER
+  if (cart->stream != NULL)
+    WaitROMStream(cart->stream, address, sizeof(word));
+#endif
+
+  memcpy(&word, rom, sizeof(word));
   *data = ByteOrderSwap32(word);
 
   return 0;
 }
 
+/* ============================================================================
+ *  CartReadDebug: Reads a cart with a debug window mapped over it.
+ * ========================================================================= */
+static int
+CartReadDebug(struct ROMController *controller,
+  uint32_t address, uint32_t *data) {
+  if (IsDebugWindow(address)) {
+    *data = DebugChannelRead(controller->debugChannel, address);
+    return 0;
+  }
+
+  if (controller->cart != NULL && controller->cart->windowed)
+    return CartReadWindow(controller, address, data);
+
+  return CartReadImage(controller, address, data);
+}
+
+/* ============================================================================
+ *  SetCartReadHandler: Picks how CartRead serves the controller, so that
+ *  reads only test for what the inserted cart and debug channel require.
+ *  Called whenever either of them changes.
+ * ========================================================================= */
+void
+SetCartReadHandler(struct ROMController *controller) {
+  struct Cart *cart = controller->cart;
+
+  if (controller->debugChannel != NULL)
+    controller->cartRead = CartReadDebug;
+
+  else if (cart != NULL && cart->windowed)
+    controller->cartRead = CartReadWindow;
+
+  else
+    controller->cartRead = CartReadImage;
+}
+
 /* ============================================================================
  *  CartWrite: Write to Cart.
  * ========================================================================= */
 int
-CartWrite(void *unused(controller),
-  uint32_t debugonly(address), void *unused(data)) {
-  debugarg("CartWrite: Detected write [0x%.8x]", address);
+CartWrite(void *_controller, uint32_t address, void *_data) {
+	struct ROMController *controller = (struct ROMController*) _controller;
+	uint32_t *data = (uint32_t*) _data;
 
+  struct Cart *cart = controller->cart;
+  uint8_t *rom;
+  uint32_t word;
+
+  if (controller->debugChannel != NULL && IsDebugWindow(address)) {
+    DebugChannelWrite(controller->debugChannel, address, *data);
+    return 0;
+  }
+
+  if (cart != NULL && (rom = CartLookupWritable(cart,
+    address - ROM_CART_BASE_ADDRESS, sizeof(word), NULL)) != NULL) {
+    word = ByteOrderSwap32(*data);
+    memcpy(rom, &word, sizeof(word));
+    return 0;
+  }
+
+  debugarg("CartWrite: Detected write [0x%.8x]", address);
   return 0;
 }
 
+/* ============================================================================
+ *  CartsMatch: Returns true if two carts hold the same image: the same size
+ *  and header checksums and, where the build can tell, the same file.
+ * ========================================================================= */
+bool
+CartsMatch(const struct Cart *a, const struct Cart *b) {
+  if (a == b)
+    return true;
+
+  return a->size == b->size &&
+    a->checksum[0] == b->checksum[0] && a->checksum[1] == b->checksum[1] &&
+    a->device == b->device && a->inode == b->inode;
+}
+
+/* ============================================================================
+ *  CartLookup: Returns a pointer to the image at offset, or NULL if offset
+ *  is beyond the end of the cart. If avail is not NULL, it receives the
+ *  number of contiguous bytes that can be read through the pointer.
+ * ========================================================================= */
+const uint8_t *
+CartLookup(struct Cart *cart, uint32_t offset, uint32_t *avail) {
+  const uint8_t *rom;
+  uint32_t contiguous;
+
+  if (offset >= CartSpan(cart))
+    return NULL;
+
+  if (cart->windowed) {
+    rom = cart->rom + offset;
+    contiguous = ROM_CART_ADDRESS_LEN - offset;
+  }
+
+#ifdef CACHED_ROM_IMAGE
+  else if (cart->cache != NULL) {
+    if ((rom = CartCacheLookup(cart->cache, offset, &contiguous)) == NULL)
+      return NULL;
+
+    if (contiguous > cart->size - offset)
+      contiguous = cart->size - offset;
+  }
+#endif
+
+  else {
+    rom = cart->rom + offset;
+    contiguous = cart->size - offset;
+
+#ifdef PARALLEL_ROM_LOADER
+    /* Only wait for what is needed right now: the rest of this chunk. */
+    if (cart->stream != NULL) {
+      uint32_t chunkEnd = ROM_LOAD_CHUNK_SIZE - offset % ROM_LOAD_CHUNK_SIZE;
+
+      if (contiguous > chunkEnd)
+        contiguous = chunkEnd;
+
+      WaitROMStream(cart->stream, offset, contiguous);
+    }
+#endif
+  }
+
+  if (avail != NULL)
+    *avail = contiguous;
+
+  return rom;
+}
+
+/* ============================================================================
+ *  CartLookupWritable: Returns a pointer through which up to length bytes
+ *  of the image at offset may be written, and marks them dirty; or NULL if
+ *  the cart is not writable. If avail is not NULL, it receives the number
+ *  of bytes that may be written (less than length at the end of the cart).
+ * ========================================================================= */
+uint8_t *
+CartLookupWritable(struct Cart *cart,
+  uint32_t offset, uint32_t length, uint32_t *avail) {
+  uint8_t *rom;
+
+  if (!cart->writable || offset >= cart->size || length == 0)
+    return NULL;
+
+  if (length > cart->size - offset)
+    length = cart->size - offset;
+
+  rom = ImageRange(cart, offset, length);
+  MarkCartPages(cart->dirty, offset, length);
+  MarkCartPages(cart->written, offset, length);
+
+  if (avail != NULL)
+    *avail = length;
+
+  return rom;
+}
+
+/* ============================================================================
+ *  CartCopy: Copies a range of the image out, zero-filling past the end.
+ * ========================================================================= */
+static void
+CartCopy(struct Cart *cart, void *_dest, uint32_t offset, size_t size) {
+  uint8_t *dest = (uint8_t*) _dest;
+  const uint8_t *rom;
+  uint32_t avail;
+
+  while (size > 0) {
+    if ((rom = CartLookup(cart, offset, &avail)) == NULL) {
+      memset(dest, 0, size);
+      return;
+    }
+
+    if (avail > size)
+      avail = size;
+
+    memcpy(dest, rom, avail);
+    offset += avail;
+    dest += avail;
+    size -= avail;
+  }
+}
+
 /* ============================================================================
  *  Run the reference implementation of CRC32.
  * ========================================================================= */
@@ -117,12 +547,22 @@ static uint32_t CRC32(const uint8_t *data, size_t size) {
  * ========================================================================= */
 struct Cart *
 CreateCart(const char *filename) {
-  size_t allocSize = sizeof(struct Cart);
+  return CreateCartWithOptions(filename, NULL);
+}
 
+/* ============================================================================
+ *  CreateCartWithOptions: Creates a new Cart, reporting load progress and
+ *  tuning the loader as requested (options may be NULL).
+ * ========================================================================= */
+struct Cart *
+CreateCartWithOptions(const char *filename,
+  const struct ROMLoadOptions *options) {
+  struct ROMStream *stream = NULL;
   struct Cart *cart;
   uint8_t *romImage;
   FILE *romFile;
   long romSize;
+  bool writable;
 
   if ((romFile = fopen(filename, "rb")) == NULL) {
     debug("Failed to open ROM image.");
@@ -136,29 +576,24 @@ CreateCart(const char *filename) {
     return NULL;
   }
 
-#ifndef MMAP_ROM_IMAGE
-  allocSize += romSize;
-#endif
-
-  /* Allocate memory for cart metadata and image. */
-  if ((cart = (struct Cart*) malloc(allocSize)) == NULL) {
+  /* Allocate memory for cart metadata. */
+  if ((cart = (struct Cart*) malloc(sizeof(*cart))) == NULL) {
     debug("Failed to allocate memory for ROM.");
 
     fclose(romFile);
     return NULL;
   }
 
-#ifndef MMAP_ROM_IMAGE
-  romImage = (uint8_t*) cart + sizeof(*cart);
+  writable = options && options->writable;
 
-  rewind(romFile);
-  if (!SafeFRead(romImage, romSize, romFile)) {
+#ifndef MMAP_ROM_IMAGE
+  if ((romImage = LoadCartImage(filename, romSize, options, &stream)) == NULL) {
 #else
-  int fd = fileno(romFile);
+  bool windowed;
 
-  /* Map the file directly into memory. */
-  if ((romImage = (uint8_t*) mmap(NULL, romSize,
-    PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+  /* Map the file directly into memory (copy-on-write, if writable). */
+  if ((romImage = MapCartImage(fileno(romFile),
+    romSize, writable, &windowed)) == NULL) {
 #endif
 
     debug("Failed to load ROM image.");
@@ -167,31 +602,540 @@ CreateCart(const char *filename) {
     cart = NULL;
   }
 
-  if (cart != NULL)
+  if (cart != NULL) {
+#ifdef MMAP_ROM_IMAGE
+    if (options && options->progress)
+      options->progress(options->opaque, romSize, romSize);
+#endif
+
     InitCart(cart, romFile, romImage, romSize);
+    cart->stream = stream;
+
+#ifdef MMAP_ROM_IMAGE
+    cart->mapSize = windowed ? ROM_CART_ADDRESS_LEN : (size_t) romSize;
+    cart->windowed = windowed;
+#else
+    cart->mapSize = romSize;
+#endif
+
+    if (writable) {
+      size_t numPages = (cart->size + CART_PAGE_SIZE - 1) / CART_PAGE_SIZE;
+      size_t numWords = (numPages + 31) / 32;
+
+      /* If this fails, the cart is simply left read-only. */
+      cart->dirty = (uint32_t*) calloc(2 * numWords, sizeof(*cart->dirty));
+      cart->written = cart->dirty + numWords;
+      cart->writable = cart->dirty != NULL;
+    }
+
+    cart->saveType = DetectSaveType(cart);
+    IdentifyCart(cart, fileno(romFile));
+  }
 
   fclose(romFile);
   return cart;
 }
 
+/* ============================================================================
+ *  CreateCartFromFd: Creates a new Cart over an image published by another
+ *  process (see PublishCartImage). The image is mapped, never copied, so
+ *  every process attached to it shares the same pages. The caller keeps
+ *  ownership of fd; it may be closed once this returns.
+ * ========================================================================= */
+struct Cart *
+CreateCartFromFd(int fd) {
+#if defined(MMAP_ROM_IMAGE) && defined(SHARED_ROM_IMAGE) && defined(__linux__)
+  const int required = F_SEAL_SHRINK | F_SEAL_WRITE;
+  uint8_t *romImage;
+  struct Cart *cart;
+  struct stat sb;
+  bool windowed;
+  int seals;
+
+  /* A writable or shrinkable image could change (or fault) under us, and
+   * so could one that does not support seals at all (-1, all bits set). */
+  seals = fcntl(fd, F_GET_SEALS);
+
+  if (seals == -1 || (seals & required) != required) {
+    debug("Refusing to attach to an unsealed ROM image.");
+    return NULL;
+  }
+
+  if (fstat(fd, &sb) == -1) {
+    debug("Failed to determine ROM size.");
+    return NULL;
+  }
+
+  if ((cart = (struct Cart*) malloc(sizeof(*cart))) == NULL) {
+    debug("Failed to allocate memory for ROM.");
+    return NULL;
+  }
+
+  if ((romImage = MapCartImage(fd, sb.st_size, false, &windowed)) == NULL) {
+    debug("Failed to map the shared ROM image.");
+
+    free(cart);
+    return NULL;
+  }
+
+  InitCart(cart, NULL, romImage, sb.st_size);
+  cart->mapSize = windowed ? ROM_CART_ADDRESS_LEN : (size_t) sb.st_size;
+  cart->windowed = windowed;
+  cart->saveType = DetectSaveType(cart);
+  IdentifyCart(cart, fd);
+  return cart;
+#else
+  debug("Shared carts are not supported by this build.");
+
+  (void) fd;
+  return NULL;
+#endif
+}
+
+/* ============================================================================
+ *  CreateCachedCart: Creates a new Cart whose image is not held in memory;
+ *  at most budget bytes of it are kept resident in a block cache.
+ * ========================================================================= */
+struct Cart *
+CreateCachedCart(const char *filename, size_t budget) {
+#ifdef CACHED_ROM_IMAGE
+  struct CartCache *cache;
+  struct Cart *cart;
+  struct stat sb;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) == -1) {
+    debug("Failed to open ROM image.");
+    return NULL;
+  }
+
+  if (fstat(fd, &sb) == -1) {
+    debug("Failed to determine ROM size.");
+
+    close(fd);
+    return NULL;
+  }
+
+  if ((cart = (struct Cart*) malloc(sizeof(*cart))) == NULL) {
+    debug("Failed to allocate memory for ROM.");
+
+    close(fd);
+    return NULL;
+  }
+
+  if ((cache = CreateCartCache(fd, sb.st_size, budget)) == NULL) {
+    close(fd);
+    free(cart);
+    return NULL;
+  }
+
+  InitCart(cart, NULL, NULL, sb.st_size);
+  cart->cache = cache;
+  cart->saveType = DetectSaveType(cart);
+  IdentifyCart(cart, fd);
+  return cart;
+#else
+  debug("Cached carts are not supported by this build.");
+
+  (void) filename;
+  (void) budget;
+  return NULL;
+#endif
+}
+
+/* ============================================================================
+ *  DetectSaveType: Determines the save hardware from the cart header.
+ *
+ *  Homebrew marks itself with the game code "ED" and encodes the save type
+ *  in the upper nibble of the version byte; retail carts are looked up by
+ *  game code.
+ * ========================================================================= */
+static enum CartSaveType
+DetectSaveType(struct Cart *cart) {
+  uint8_t header[0x40];
+  size_t i;
+
+  CartCopy(cart, header, 0, sizeof(header));
+
+  if (header[0x3C] == 'E' && header[0x3D] == 'D') {
+    switch(header[0x3F] >> 4) {
+      case 0:
+        return SAVE_TYPE_NONE;
+
+      case 1:
+        return SAVE_TYPE_EEPROM_4K;
+
+      case 2:
+        return SAVE_TYPE_EEPROM_16K;
+
+      case 4:
+        return SAVE_TYPE_SRAM_768K;
+
+      case 5:
+        return SAVE_TYPE_FLASHRAM;
+
+      case 6:
+        return SAVE_TYPE_SRAM_1M;
+
+      default:
+        return SAVE_TYPE_SRAM;
+    }
+  }
+
+  for (i = 0; i < sizeof(CartSaveTable) / sizeof(*CartSaveTable); i++) {
+    const struct CartSaveEntry *entry = CartSaveTable + i;
+
+    if (header[0x3C] == entry->id[0] && header[0x3D] == entry->id[1]) {
+      debugarg("Detected save type: %d.", entry->saveType);
+      return entry->saveType;
+    }
+  }
+
+  debug("Cart is not in the save database; assuming SRAM.");
+  return SAVE_TYPE_SRAM;
+}
+
 /* ============================================================================
  *  DestroyCart: Deallocates memory reserved for a Cart. 
  * ========================================================================= */
 void
 DestroyCart(struct Cart *cart) {
+  free(cart->dirty);
+
+#ifdef CACHED_ROM_IMAGE
+  if (cart->cache != NULL) {
+    DestroyCartCache(cart->cache);
+    free(cart);
+    return;
+  }
+#endif
+
 #ifdef MMAP_ROM_IMAGE
-  munmap((void*) cart->rom, cart->size);
+  munmap((void*) cart->rom, cart->mapSize);
+#else
+#ifdef PARALLEL_ROM_LOADER
+  if (cart->stream != NULL)
+    FinishROMStream(cart->stream);
+#endif
+
+  FreeROMImage((uint8_t*) cart->rom);
 #endif
 
   free(cart);
 }
 
+#ifdef MMAP_ROM_IMAGE
+/* ============================================================================
+ *  MapCartImage: Maps an image, over all of cart space if we can (in which
+ *  case *windowed is set). Returns NULL on failure. A writable mapping is
+ *  private: written pages are copied, all others stay shared with the page
+ *  cache and with other instances.
+ * ========================================================================= */
+static uint8_t *
+MapCartImage(int fd, size_t size, bool writable, bool *windowed) {
+  int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  uint8_t *image;
+
+  if ((image = MapCartWindow(fd, size, writable)) != NULL) {
+    *windowed = true;
+    return image;
+  }
+
+  if ((image = (uint8_t*) mmap(NULL, size,
+    prot, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    return NULL;
+
+  *windowed = false;
+  return image;
+}
+
+/* ============================================================================
+ *  MapCartWindow: Reserves all of cart space and maps the image over the
+ *  start of it, so that reads anywhere in cart space need no bounds check
+ *  and can never fault. Power-of-two images are mirrored across the whole
+ *  window, as the address lines simply wrap; past the end of any other
+ *  image, reads return zero. Returns NULL if the window can't be mapped.
+ * ========================================================================= */
+static uint8_t *
+MapCartWindow(int fd, size_t size, bool writable) {
+  int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t mapSize = (size + page - 1) & ~(page - 1);
+  size_t offset, stride;
+  uint8_t *window;
+
+  if (size == 0 || mapSize > ROM_CART_ADDRESS_LEN)
+    return NULL;
+
+  /* Untouched anonymous pages all share the zero page. */
+  if ((window = (uint8_t*) mmap(NULL, ROM_CART_ADDRESS_LEN, PROT_READ,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED)
+    return NULL;
+
+  /* Mirrors are separate mappings; they would not see writes. */
+  stride = (size & (size - 1)) == 0 && size >= page && !writable
+    ? size : ROM_CART_ADDRESS_LEN;
+
+  for (offset = 0; offset < ROM_CART_ADDRESS_LEN; offset += stride) {
+    size_t length = ROM_CART_ADDRESS_LEN - offset;
+
+    if (length > mapSize)
+      length = mapSize;
+
+    if (mmap(window + offset, length, prot,
+      MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      debug("Failed to map the cart window.");
+
+      munmap(window, ROM_CART_ADDRESS_LEN);
+      return NULL;
+    }
+  }
+
+  return window;
+}
+
+#else
+/* ============================================================================
+ *  LoadCartImage: Allocates and loads the image. For a progressive load,
+ *  only the start of the image is present on return; *stream tracks the
+ *  rest of it.
+ * ========================================================================= */
+static uint8_t *
+LoadCartImage(const char *filename, size_t size,
+  const struct ROMLoadOptions *options, struct ROMStream **stream) {
+  uint8_t *image;
+
+  if ((image = AllocROMImage(size)) == NULL)
+    return NULL;
+
+#ifdef PARALLEL_ROM_LOADER
+  if (options && options->progressive) {
+    if ((*stream = StartROMStream(filename, image, size, options)) != NULL)
+      return image;
+
+    FreeROMImage(image);
+    return NULL;
+  }
+#else
+  (void) stream;
+#endif
+
+  if (LoadROMImage(filename, image, size, options)) {
+    FreeROMImage(image);
+    return NULL;
+  }
+
+  return image;
+}
+#endif
+
+/* ============================================================================
+ *  GetCartSaveSize: Returns the size of the save memory, in bytes.
+ * ========================================================================= */
+size_t
+GetCartSaveSize(enum CartSaveType saveType) {
+  switch(saveType) {
+    case SAVE_TYPE_EEPROM_4K:
+      return 512;
+
+    case SAVE_TYPE_EEPROM_16K:
+      return 2048;
+
+    case SAVE_TYPE_SRAM:
+      return 32768;
+
+    case SAVE_TYPE_SRAM_768K:
+      return 98304;
+
+    case SAVE_TYPE_SRAM_1M:
+    case SAVE_TYPE_FLASHRAM:
+      return 131072;
+
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+/* ============================================================================
+ *  FlushCartWrites: Saves every page the cart has ever written to a sidecar
+ *  file, for LoadCartWrites to replay. Each record is a big-endian offset
+ *  and length followed by the data. The file is a snapshot, written beside
+ *  filename and then renamed over it, so it never holds more than the
+ *  written pages and a failed flush leaves the last one intact. Must not
+ *  race with the CPU. Returns 0 on success.
+ * ========================================================================= */
+int
+FlushCartWrites(struct ROMController *controller, const char *filename) {
+  struct Cart *cart = controller->cart;
+  uint32_t numPages, page;
+  int status = 0;
+  char *temp;
+  FILE *file;
+
+  if (cart == NULL || !cart->writable)
+    return -1;
+
+  if ((temp = (char*) malloc(strlen(filename) + sizeof(".tmp"))) == NULL)
+    return -1;
+
+  sprintf(temp, "%s.tmp", filename);
+
+  if ((file = fopen(temp, "wb")) == NULL) {
+    debug("Failed to open the cart write file.");
+
+    free(temp);
+    return -1;
+  }
+
+  numPages = (cart->size + CART_PAGE_SIZE - 1) / CART_PAGE_SIZE;
+
+  for (page = 0; page < numPages && status == 0; page++) {
+    uint32_t offset = page * CART_PAGE_SIZE;
+    uint32_t length = cart->size - offset;
+    uint32_t header[2];
+
+    if (!(cart->written[page / 32] & (1U << (page % 32))))
+      continue;
+
+    if (length > CART_PAGE_SIZE)
+      length = CART_PAGE_SIZE;
+
+    header[0] = ByteOrderSwap32(offset);
+    header[1] = ByteOrderSwap32(length);
+
+    if (fwrite(header, sizeof(header), 1, file) != 1 ||
+      fwrite(cart->rom + offset, length, 1, file) != 1)
+      status = -1;
+  }
+
+  if (fclose(file) || status || rename(temp, filename)) {
+    debug("Failed to write the cart write file.");
+
+    remove(temp);
+    free(temp);
+    return -1;
+  }
+
+  memset(cart->dirty, 0, (numPages + 31) / 32 * sizeof(*cart->dirty));
+  free(temp);
+  return 0;
+}
+
+/* ============================================================================
+ *  LoadCartWrites: Replays a file written by FlushCartWrites onto a newly
+ *  inserted writable cart. The whole file is checked first: if any record
+ *  is malformed, the image is left untouched (only a read error part way
+ *  through the replay can leave it partly applied). Returns 0 on success.
+ * ========================================================================= */
+int
+LoadCartWrites(struct ROMController *controller, const char *filename) {
+  struct Cart *cart = controller->cart;
+  uint32_t header[2];
+  long size, position;
+  FILE *file;
+  int status = 0;
+
+  if (cart == NULL || !cart->writable)
+    return -1;
+
+  if ((file = fopen(filename, "rb")) == NULL)
+    return -1;
+
+  if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0)
+    status = -1;
+
+  /* Walk the records without applying them. */
+  for (position = 0; status == 0 && position < size;
+    position += sizeof(header) + ByteOrderSwap32(header[1])) {
+    uint32_t offset, length;
+
+    if (fseek(file, position, SEEK_SET) ||
+      fread(header, sizeof(header), 1, file) != 1) {
+      status = -1;
+      break;
+    }
+
+    offset = ByteOrderSwap32(header[0]);
+    length = ByteOrderSwap32(header[1]);
+
+    if (offset > cart->size || length > cart->size - offset ||
+      length > (unsigned long) (size - position) - sizeof(header))
+      status = -1;
+  }
+
+  if (status != 0) {
+    debug("Ignoring a malformed cart write file.");
+  }
+
+  else
+    rewind(file);
+
+  while (status == 0 && fread(header, sizeof(header), 1, file) == 1) {
+    uint32_t offset = ByteOrderSwap32(header[0]);
+    uint32_t length = ByteOrderSwap32(header[1]);
+
+    /* Zero-length records are valid, if pointless. */
+    if (length > 0 &&
+      fread(ImageRange(cart, offset, length), length, 1, file) != 1) {
+      debug("Failed to read the cart write file.");
+
+      status = -1;
+      break;
+    }
+
+    MarkCartPages(cart->written, offset, length);
+  }
+
+  fclose(file);
+  return status;
+}
+
+/* ============================================================================
+ *  GetCartMemoryUsage: Adds what the cart holds to usage. Only the image
+ *  itself is checked for residency; its mirrors and the zero pages behind
+ *  it in a windowed mapping are not.
+ * ========================================================================= */
+void
+GetCartMemoryUsage(const struct Cart *cart, struct ROMMemoryUsage *usage) {
+  usage->romSize += cart->size;
+  usage->other += sizeof(*cart);
+
+#ifdef CACHED_ROM_IMAGE
+  if (cart->cache != NULL) {
+    usage->cartCache += GetCartCacheSize(cart->cache);
+    return;
+  }
+#endif
+
+  usage->romMapped += cart->mapSize;
+  usage->romResident += ResidentSize(cart->rom, cart->size);
+
+  if (cart->writable) {
+    uint32_t numPages = (cart->size + CART_PAGE_SIZE - 1) / CART_PAGE_SIZE;
+    uint32_t i, bits;
+
+    usage->other += 2 * ((numPages + 31) / 32) * sizeof(*cart->dirty);
+
+    /* Flushing does not give the private copies back; count them all. */
+    for (i = 0; i < (numPages + 31) / 32; i++) {
+      for (bits = cart->written[i]; bits; bits &= bits - 1)
+        usage->romDirty += CART_PAGE_SIZE;
+    }
+  }
+}
+
 /* ============================================================================
  *  GetCICSeed: Returns the proper CIC seed value depending on the cart header.
  * ========================================================================= */
 uint32_t
 GetCICSeed(const struct ROMController *controller) {
-  uint32_t crc = CRC32(controller->cart->rom + 0x40, 4096 - 0x40);
+  uint8_t bootcode[4096 - 0x40];
+  uint32_t crc;
+
+  CartCopy(controller->cart, bootcode, 0x40, sizeof(bootcode));
+  crc = CRC32(bootcode, sizeof(bootcode));
 
   switch(crc) {
     case CRC_CIC_NUS_6101:
@@ -228,7 +1172,7 @@ GetCICSeed(const struct ROMController *controller) {
  * ========================================================================= */
 void
 GetROMTitle(const struct ROMController *controller, ROMTitle title) {
-  memcpy(title, controller->cart->rom + 0x20, 20);
+  CartCopy(controller->cart, title, 0x20, 20);
   title[20] = '\0';
 }
 
@@ -246,19 +1190,100 @@ InitCart(struct Cart *cart, FILE *file, const uint8_t *rom, size_t size) {
   cart->size = size;
 }
 
-#ifndef MMAP_ROM_IMAGE
 /* ============================================================================
- *  SafeFRead: Check return values from fread, read in 1 byte chunks.
+ *  IdentifyCart: Records what CartsMatch compares: the checksums from the
+ *  header and, if the build has fstat, the file the image came from.
  * ========================================================================= */
-static int SafeFRead(uint8_t *memory, size_t size, FILE *file) {
-  size_t i, read = 0;
+static void
+IdentifyCart(struct Cart *cart, int fd) {
+#if defined(CACHED_ROM_IMAGE) || defined(SHARED_ROM_IMAGE)
+  struct stat sb;
+#endif
+  uint8_t header[0x18];
+  unsigned i;
 
-  for (i = 0; i < size; i += read) {
-    if ((read = fread(memory + i, size - i, 1, file)) == 0)
-      return 1;
+  CartCopy(cart, header, 0, sizeof(header));
+
+  for (i = 0; i < 4; i++) {
+    cart->checksum[0] = cart->checksum[0] << 8 | header[0x10 + i];
+    cart->checksum[1] = cart->checksum[1] << 8 | header[0x14 + i];
   }
 
-  return 0;
+#if defined(CACHED_ROM_IMAGE) || defined(SHARED_ROM_IMAGE)
+  if (fstat(fd, &sb) == 0) {
+    cart->device = sb.st_dev;
+    cart->inode = sb.st_ino;
+  }
+#else
+  (void) fd;
+#endif
+}
+
+/* ============================================================================
+ *  MarkCartPages: Sets the bit for every page of a range in a page bitmap.
+ * ========================================================================= */
+static void
+MarkCartPages(uint32_t *bitmap, uint32_t offset, uint32_t length) {
+  uint32_t last = (offset + length - 1) / CART_PAGE_SIZE;
+  uint32_t page;
+
+  if (length == 0)
+    return;
+
+  for (page = offset / CART_PAGE_SIZE; page <= last; page++)
+    bitmap[page / 32] |= 1U << (page % 32);
 }
+
+/* ============================================================================
+ *  ImageRange: Returns a writable pointer to a range of the image, once it
+ *  has been loaded.
+ * ========================================================================= */
+static uint8_t *
+ImageRange(struct Cart *cart, uint32_t offset, uint32_t length) {
+#ifdef PARALLEL_ROM_LOADER
+  if (cart->stream != NULL)
+    WaitROMStream(cart->stream, offset, length);
+#else
+  (void) length;
 #endif
 
+  return (uint8_t*) cart->rom + offset;
+}
+
+/* ============================================================================
+ *  ResidentSize: Returns how much of a range is resident in memory. Where
+ *  that can't be determined, all of it is assumed to be.
+ * ========================================================================= */
+static size_t
+ResidentSize(const void *start, size_t size) {
+#ifdef __linux__
+  size_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t first = (uintptr_t) start & ~(page - 1);
+  uintptr_t end = ((uintptr_t) start + size + page - 1) & ~(page - 1);
+  unsigned char vec[256];
+  size_t resident = 0;
+
+  while (first < end) {
+    size_t pages = (end - first) / page;
+    size_t i;
+
+    if (pages > sizeof(vec))
+      pages = sizeof(vec);
+
+    if (mincore((void*) first, pages * page, vec))
+      return size;
+
+    for (i = 0; i < pages; i++)
+      resident += vec[i] & 1;
+
+    first += pages * page;
+  }
+
+  resident *= page;
+  return resident < size ? resident : size;
+#else
+  (void) start;
+  return size;
+#endif
+}
+
@@ -10,23 +10,82 @@
  * ========================================================================= */
 #ifndef __ROM__CART_H__
 #define __ROM__CART_H__
+#include "Address.h"
 #include "Common.h"
+#include "Loader.h"
 #include <stdio.h>
 
+/* Granularity at which writes to the image are tracked. */
+#define CART_PAGE_SIZE            0x1000
+
+struct CartCache;
+
+enum CartSaveType {
+  SAVE_TYPE_NONE,
+  SAVE_TYPE_EEPROM_4K,
+  SAVE_TYPE_EEPROM_16K,
+  SAVE_TYPE_SRAM,
+  SAVE_TYPE_SRAM_768K,
+  SAVE_TYPE_SRAM_1M,
+  SAVE_TYPE_FLASHRAM
+};
+
 struct Cart {
   FILE *file;
+  struct CartCache *cache;
+  struct ROMStream *stream;
   const uint8_t *rom;
   unsigned size;
+
+  /* rom spans all of cart space (see MapCartWindow). */
+  size_t mapSize;
+  bool windowed;
+
+  /* One bit per CART_PAGE_SIZE page written since the last flush, and one
+   * per page ever written (which, when mapped, holds a private copy). */
+  uint32_t *dirty;
+  uint32_t *written;
+  bool writable;
+
+  enum CartSaveType saveType;
+
+  /* Identifies the image (see CartsMatch); zero where unknown. */
+  uint64_t device, inode;
+  uint32_t checksum[2];
 };
 
 struct ROMController;
+struct ROMMemoryUsage;
 typedef char ROMTitle[32];
 
 struct Cart *CreateCart(const char *);
+struct Cart *CreateCartWithOptions(const char *,
+  const struct ROMLoadOptions *);
+struct Cart *CreateCachedCart(const char *, size_t);
+struct Cart *CreateCartFromFd(int);
 void DestroyCart(struct Cart *);
 
+void SetCartReadHandler(struct ROMController *);
+
+bool CartsMatch(const struct Cart *, const struct Cart *);
+const uint8_t *CartLookup(struct Cart *, uint32_t, uint32_t *);
+uint8_t *CartLookupWritable(struct Cart *, uint32_t, uint32_t, uint32_t *);
+void GetCartMemoryUsage(const struct Cart *, struct ROMMemoryUsage *);
+
+/* ============================================================================
+ *  CartSpan: Returns how far into cart space CartLookup can read.
+ * ========================================================================= */
+static inline uint32_t
+CartSpan(const struct Cart *cart) {
+  return cart->windowed ? ROM_CART_ADDRESS_LEN : cart->size;
+}
+
+size_t GetCartSaveSize(enum CartSaveType);
 uint32_t GetCICSeed(const struct ROMController *);
 void GetROMTitle(const struct ROMController *, ROMTitle );
 
+int FlushCartWrites(struct ROMController *, const char *);
+int LoadCartWrites(struct ROMController *, const char *);
+
 #endif
 
@@ -0,0 +1,240 @@
+/* ============================================================================
+ *  CartCache.c: Bounded-memory cartridge block cache.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "CartCache.h"
+#include "Common.h"
+
+#ifdef __cplusplus
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#else
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#ifdef CACHED_ROM_IMAGE
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CART_CACHE_NO_SLOT 0xFFFFFFFFU
+
+/* ============================================================================
+ *  Each slot holds one block of the image; the slots form a doubly-linked
+ *  LRU list (head = most recently used, tail = next victim).
+ * ========================================================================= */
+struct CartCacheSlot {
+  uint32_t block;
+  uint32_t prev;
+  uint32_t next;
+};
+
+struct CartCache {
+  int fd;
+  size_t romSize;
+
+  uint32_t numBlocks;
+  uint32_t numSlots;
+  uint32_t head, tail;
+
+  uint32_t lastMiss;
+  unsigned streak;
+
+  uint32_t *map;
+  struct CartCacheSlot *slots;
+  uint8_t *data;
+};
+
+static void FillSlot(struct CartCache *, uint32_t, uint32_t);
+static void TouchSlot(struct CartCache *, uint32_t);
+
+/* ============================================================================
+ *  CartCacheLookup: Returns a pointer to the image at offset, filling the
+ *  block from the backing file on a miss. If avail is not NULL, it receives
+ *  the number of contiguous bytes that can be read through the pointer.
+ * ========================================================================= */
+const uint8_t *
+CartCacheLookup(struct CartCache *cache, uint32_t offset, uint32_t *avail) {
+  uint32_t block = offset / CART_CACHE_BLOCK_SIZE;
+  uint32_t within = offset % CART_CACHE_BLOCK_SIZE;
+  uint32_t slot;
+
+  if (unlikely(block >= cache->numBlocks))
+    return NULL;
+
+  if ((slot = cache->map[block]) == CART_CACHE_NO_SLOT) {
+    slot = cache->tail;
+
+    if (cache->slots[slot].block != CART_CACHE_NO_SLOT)
+      cache->map[cache->slots[slot].block] = CART_CACHE_NO_SLOT;
+
+    /* Sequential misses: ask the kernel to start on what comes next. */
+    cache->streak = (block == cache->lastMiss + 1) ? cache->streak + 1 : 0;
+    cache->lastMiss = block;
+
+    if (cache->streak >= 2) {
+      posix_fadvise(cache->fd, (off_t) (block + 1) * CART_CACHE_BLOCK_SIZE,
+        (off_t) CART_CACHE_READAHEAD * CART_CACHE_BLOCK_SIZE,
+        POSIX_FADV_WILLNEED);
+    }
+
+    FillSlot(cache, slot, block);
+    cache->map[block] = slot;
+  }
+
+  if (slot != cache->head)
+    TouchSlot(cache, slot);
+
+  if (avail != NULL)
+    *avail = CART_CACHE_BLOCK_SIZE - within;
+
+  return cache->data + (size_t) slot * CART_CACHE_BLOCK_SIZE + within;
+}
+
+/* ============================================================================
+ *  CreateCartCache: Creates a cache of at most budget bytes over fd.
+ *  The cache takes ownership of fd and closes it when destroyed.
+ * ========================================================================= */
+struct CartCache *
+CreateCartCache(int fd, size_t romSize, size_t budget) {
+  struct CartCache *cache;
+  uint32_t i;
+
+  if ((cache = (struct CartCache*) calloc(1, sizeof(*cache))) == NULL) {
+    debug("Failed to allocate memory for the cart cache.");
+    return NULL;
+  }
+
+  /* One spare block so reads at the very end of the image never miss. */
+  cache->numBlocks = romSize / CART_CACHE_BLOCK_SIZE + 1;
+  cache->numSlots = budget / CART_CACHE_BLOCK_SIZE;
+
+  if (cache->numSlots > cache->numBlocks)
+    cache->numSlots = cache->numBlocks;
+
+  if (cache->numSlots == 0)
+    cache->numSlots = 1;
+
+  cache->map = (uint32_t*) malloc(cache->numBlocks * sizeof(*cache->map));
+  cache->slots = (struct CartCacheSlot*) malloc(
+    cache->numSlots * sizeof(*cache->slots));
+  cache->data = (uint8_t*) malloc(
+    (size_t) cache->numSlots * CART_CACHE_BLOCK_SIZE);
+
+  if (!cache->map || !cache->slots || !cache->data) {
+    debug("Failed to allocate memory for the cart cache.");
+
+    free(cache->data);
+    free(cache->slots);
+    free(cache->map);
+    free(cache);
+    return NULL;
+  }
+
+  for (i = 0; i < cache->numBlocks; i++)
+    cache->map[i] = CART_CACHE_NO_SLOT;
+
+  for (i = 0; i < cache->numSlots; i++) {
+    cache->slots[i].block = CART_CACHE_NO_SLOT;
+    cache->slots[i].prev = i - 1;
+    cache->slots[i].next = i + 1;
+  }
+
+  cache->slots[cache->numSlots - 1].next = CART_CACHE_NO_SLOT;
+  cache->head = 0;
+  cache->tail = cache->numSlots - 1;
+  cache->lastMiss = CART_CACHE_NO_SLOT - 1;
+
+  cache->fd = fd;
+  cache->romSize = romSize;
+
+  /* Readahead is driven by the stream detector, not the kernel. */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+  debugarg("Cart cache: %u blocks resident.", cache->numSlots);
+  return cache;
+}
+
+/* ============================================================================
+ *  DestroyCartCache: Releases the cache and closes the backing file.
+ * ========================================================================= */
+void
+DestroyCartCache(struct CartCache *cache) {
+  close(cache->fd);
+
+  free(cache->data);
+  free(cache->slots);
+  free(cache->map);
+  free(cache);
+}
+
+/* ============================================================================
+ *  GetCartCacheSize: Returns the memory held by the cache, in bytes.
+ * ========================================================================= */
+size_t
+GetCartCacheSize(const struct CartCache *cache) {
+  return sizeof(*cache) +
+    (size_t) cache->numSlots * CART_CACHE_BLOCK_SIZE +
+    cache->numSlots * sizeof(*cache->slots) +
+    cache->numBlocks * sizeof(*cache->map);
+}
+
+/* ============================================================================
+ *  FillSlot: Reads a block of the image into a slot. Anything that lies
+ *  beyond the end of the file (or cannot be read) is zero-filled.
+ * ========================================================================= */
+static void
+FillSlot(struct CartCache *cache, uint32_t slot, uint32_t block) {
+  uint8_t *data = cache->data + (size_t) slot * CART_CACHE_BLOCK_SIZE;
+  off_t offset = (off_t) block * CART_CACHE_BLOCK_SIZE;
+  size_t cur = 0;
+
+  while (cur < CART_CACHE_BLOCK_SIZE) {
+    ssize_t ret = pread(cache->fd, data + cur,
+      CART_CACHE_BLOCK_SIZE - cur, offset + cur);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret <= 0)
+      break;
+
+    cur += ret;
+  }
+
+  memset(data + cur, 0, CART_CACHE_BLOCK_SIZE - cur);
+  cache->slots[slot].block = block;
+}
+
+/* ============================================================================
+ *  TouchSlot: Moves a slot to the head of the LRU list.
+ * ========================================================================= */
+static void
+TouchSlot(struct CartCache *cache, uint32_t slot) {
+  struct CartCacheSlot *s = cache->slots + slot;
+
+  /* Unlink; slot is not the head, so it always has a predecessor. */
+  cache->slots[s->prev].next = s->next;
+
+  if (s->next != CART_CACHE_NO_SLOT)
+    cache->slots[s->next].prev = s->prev;
+  else
+    cache->tail = s->prev;
+
+  s->prev = CART_CACHE_NO_SLOT;
+  s->next = cache->head;
+  cache->slots[cache->head].prev = slot;
+  cache->head = slot;
+}
+#endif
+
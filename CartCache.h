@@ -0,0 +1,33 @@
+/* ============================================================================
+ *  CartCache.h: Bounded-memory cartridge block cache.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#ifndef __ROM__CARTCACHE_H__
+#define __ROM__CARTCACHE_H__
+#include "Common.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#else
+#include <stddef.h>
+#endif
+
+#define CART_CACHE_BLOCK_SIZE     0x10000
+#define CART_CACHE_READAHEAD      8
+
+struct CartCache;
+
+struct CartCache *CreateCartCache(int, size_t, size_t);
+void DestroyCartCache(struct CartCache *);
+
+const uint8_t *CartCacheLookup(struct CartCache *, uint32_t, uint32_t *);
+size_t GetCartCacheSize(const struct CartCache *);
+
+#endif
+
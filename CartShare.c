@@ -0,0 +1,192 @@
+/* ============================================================================
+ *  CartShare.c: Sharing cart images between processes.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#if defined(SHARED_ROM_IMAGE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "Cart.h"
+#include "CartShare.h"
+#include "Common.h"
+
+#ifdef __cplusplus
+#include <cerrno>
+#include <cstring>
+#else
+#include <errno.h>
+#include <string.h>
+#endif
+
+#if defined(SHARED_ROM_IMAGE) && defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define CART_SHARE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | \
+  F_SEAL_WRITE | F_SEAL_SEAL)
+
+/* ============================================================================
+ *  A broker (or whichever process loads the cart first) publishes the image
+ *  in a sealed memfd and hands the descriptor to every other instance over
+ *  a Unix socket. Those attach to it with CreateCartFromFd, so there is one
+ *  copy of the image in memory however many instances are running. The
+ *  seals guarantee that the image can never change once published.
+ * ========================================================================= */
+
+/* ============================================================================
+ *  PublishCartImage: Copies a cart's image into a new sealed memfd and
+ *  returns the descriptor, or -1 on failure. The cart may be destroyed
+ *  afterwards; the image lives on as long as any descriptor or mapping.
+ * ========================================================================= */
+int
+PublishCartImage(struct Cart *cart) {
+  uint32_t offset = 0;
+  int fd;
+
+  if ((fd = memfd_create("rom", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+    debug("Failed to create the shared ROM image.");
+    return -1;
+  }
+
+  if (ftruncate(fd, cart->size) == -1)
+    goto fail;
+
+  while (offset < cart->size) {
+    const uint8_t *rom;
+    uint32_t avail;
+    ssize_t ret;
+
+    if ((rom = CartLookup(cart, offset, &avail)) == NULL)
+      goto fail;
+
+    if (avail > cart->size - offset)
+      avail = cart->size - offset;
+
+    if ((ret = pwrite(fd, rom, avail, offset)) == -1 && errno == EINTR)
+      continue;
+
+    if (ret <= 0)
+      goto fail;
+
+    offset += ret;
+  }
+
+  if (fcntl(fd, F_ADD_SEALS, CART_SHARE_SEALS) == -1)
+    goto fail;
+
+  return fd;
+
+fail:
+  debug("Failed to publish the shared ROM image.");
+
+  close(fd);
+  return -1;
+}
+
+/* ============================================================================
+ *  ReceiveCartImage: Receives an image descriptor sent with SendCartImage.
+ *  Returns the descriptor, or -1 on failure.
+ * ========================================================================= */
+int
+ReceiveCartImage(int socket) {
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t ret;
+  char tag;
+  int fd;
+
+  iov.iov_base = &tag;
+  iov.iov_len = sizeof(tag);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  while ((ret = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC)) == -1 &&
+    errno == EINTR);
+
+  if (ret != sizeof(tag) || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+    cmsg->cmsg_len != CMSG_LEN(sizeof(fd))) {
+    debug("Failed to receive the shared ROM image.");
+    return -1;
+  }
+
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+  return fd;
+}
+
+/* ============================================================================
+ *  SendCartImage: Passes an image descriptor to the process at the other
+ *  end of a Unix socket. Returns 0 on success.
+ * ========================================================================= */
+int
+SendCartImage(int socket, int fd) {
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  char tag = 'R';
+  ssize_t ret;
+
+  iov.iov_base = &tag;
+  iov.iov_len = sizeof(tag);
+
+  memset(&control, 0, sizeof(control));
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+  while ((ret = sendmsg(socket, &msg, MSG_NOSIGNAL)) == -1 &&
+    errno == EINTR);
+
+  return ret == sizeof(tag) ? 0 : -1;
+}
+
+#else
+int
+PublishCartImage(struct Cart *unused(cart)) {
+  debug("Shared carts are not supported by this build.");
+  return -1;
+}
+
+int
+ReceiveCartImage(int unused(socket)) {
+  return -1;
+}
+
+int
+SendCartImage(int unused(socket), int unused(fd)) {
+  return -1;
+}
+#endif
+
@@ -0,0 +1,21 @@
+/* ============================================================================
+ *  CartShare.h: Sharing cart images between processes.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#ifndef __ROM__CARTSHARE_H__
+#define __ROM__CARTSHARE_H__
+#include "Cart.h"
+#include "Common.h"
+
+int PublishCartImage(struct Cart *);
+int SendCartImage(int, int);
+int ReceiveCartImage(int);
+
+#endif
+
@@ -95,6 +95,54 @@ typedef char bool;
 #define debugonly(var) var
 #endif
 
+/* ============================================================================
+ *  Atomic word access: loads acquire, stores release, and read-modify-writes
+ *  acquire-release. Only used for state that is shared with threads other
+ *  than the CPU's. Read-modify-writes return the previous value.
+ * ========================================================================= */
+#ifdef __GNUC__
+#define AtomicLoad32(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define AtomicStore32(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define AtomicAdd32(ptr, val) __atomic_fetch_add(ptr, val, __ATOMIC_ACQ_REL)
+#define AtomicAnd32(ptr, val) __atomic_fetch_and(ptr, val, __ATOMIC_ACQ_REL)
+#define AtomicOr32(ptr, val) __atomic_fetch_or(ptr, val, __ATOMIC_ACQ_REL)
+#define AtomicCAS32(ptr, expected, desired) __atomic_compare_exchange_n( \
+  ptr, expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#elif defined(_MSC_VER)
+#include <intrin.h>
+
+/* The Interlocked intrinsics are full barriers, which covers every order. */
+#define AtomicLoad32(ptr) \
+  ((uint32_t) _InterlockedOr((volatile long *) (ptr), 0))
+#define AtomicStore32(ptr, val) \
+  ((void) _InterlockedExchange((volatile long *) (ptr), (long) (val)))
+#define AtomicAdd32(ptr, val) \
+  ((uint32_t) _InterlockedExchangeAdd((volatile long *) (ptr), (long) (val)))
+#define AtomicAnd32(ptr, val) \
+  ((uint32_t) _InterlockedAnd((volatile long *) (ptr), (long) (val)))
+#define AtomicOr32(ptr, val) \
+  ((uint32_t) _InterlockedOr((volatile long *) (ptr), (long) (val)))
+#define AtomicCAS32(ptr, expected, desired) \
+  AtomicCAS32MSVC((volatile long *) (ptr), expected, desired)
+
+static inline bool AtomicCAS32MSVC(volatile long *ptr,
+  uint32_t *expected, uint32_t desired) {
+  uint32_t previous = (uint32_t) _InterlockedCompareExchange(
+    ptr, (long) desired, (long) *expected);
+
+  if (previous == *expected)
+    return true;
+
+  *expected = previous;
+  return false;
+}
+
+#else
+#error "Couldn't determine atomic primitives for this compiler."
+#error "Use GCC/Clang/MSVC, or add the Atomic*32 macros to 'Common.h'"
+#endif
+
 /* ============================================================================
  *  Host byte order swap functions.
  * ========================================================================= */
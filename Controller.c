@@ -13,6 +13,7 @@
 #include "Cart.h"
 #include "Common.h"
 #include "Controller.h"
+#include "DebugChannel.h"
 
 #ifdef __cplusplus
 #include <cassert>
@@ -26,6 +27,10 @@
 #include <string.h>
 #endif
 
+#ifdef _POSIX_C_SOURCE
+#include <pthread.h>
+#endif
+
 /* ============================================================================
  *  Mnemonics table.
  * ========================================================================= */
@@ -37,7 +42,21 @@ const char *PIRegisterMnemonics[NUM_PI_REGISTERS] = {
 };
 #endif
 
+/* Every live controller, for GetAllROMMemoryUsage. */
+static struct ROMController *Controllers;
+
+#ifdef _POSIX_C_SOURCE
+static pthread_mutex_t ControllersLock = PTHREAD_MUTEX_INITIALIZER;
+#else
+static uint32_t ControllersLock;
+#endif
+
+static void AddROMMemoryUsage(const struct ROMController *,
+  struct ROMMemoryUsage *);
 static void InitROM(struct ROMController *);
+static int InitSRAM(struct ROMController *);
+static void LockControllers(void);
+static void UnlockControllers(void);
 
 /* ============================================================================
  *  ConnectROMToBus: Connects a ROM instance to a Bus instance.
@@ -47,6 +66,18 @@ ConnectROMToBus(struct ROMController *rom, struct BusController *bus) {
   rom->bus = bus;
 }
 
+/* ============================================================================
+ *  ConnectROMToRDRAM: Lets the controller copy DMAs straight into the host's
+ *  RDRAM instead of going through DMAToDRAM/DMAFromDRAM. The buffer must be
+ *  in the byte order that DMAToDRAM expects its source in. Passing NULL
+ *  reverts to the bus externs.
+ * ========================================================================= */
+void
+ConnectROMToRDRAM(struct ROMController *rom, void *rdram, size_t size) {
+  rom->rdram = (uint8_t*) rdram;
+  rom->rdramSize = rdram != NULL ? size : 0;
+}
+
 /* ============================================================================
  *  CreateROM: Creates and initializes an ROM instance.
  * ========================================================================= */
@@ -61,6 +92,21 @@ CreateROM(void) {
   }
 
   InitROM(controller);
+
+  if (InitSRAM(controller)) {
+    free(controller);
+    return NULL;
+  }
+
+  LockControllers();
+  controller->next = Controllers;
+
+  if (Controllers != NULL)
+    Controllers->prev = controller;
+
+  Controllers = controller;
+  UnlockControllers();
+
   return controller;
 }
 
@@ -69,7 +115,19 @@ CreateROM(void) {
  * ========================================================================= */
 void
 DestroyROM(struct ROMController *controller) {
-  if (controller->sramFile) {
+  LockControllers();
+
+  if (controller->prev != NULL)
+    controller->prev->next = controller->next;
+  else
+    Controllers = controller->next;
+
+  if (controller->next != NULL)
+    controller->next->prev = controller->prev;
+
+  UnlockControllers();
+
+  if (controller->sramFile && PIHasSRAM(controller)) {
     if (WriteSRAMFile(controller))
       printf("Failed to write the SRAM file.\n");
   }
@@ -77,9 +135,73 @@ DestroyROM(struct ROMController *controller) {
   if (controller->cart)
     DestroyCart(controller->cart);
 
+  if (controller->debugChannel)
+    DestroyDebugChannel(controller->debugChannel);
+
+  free(controller->sram);
   free(controller);
 }
 
+/* ============================================================================
+ *  EnableDebugChannel: Maps a development cart debug window into cart space
+ *  (see DebugChannel.h); returns the channel, or NULL on failure. See
+ *  CreateDebugChannel for the meaning of the arguments.
+ * ========================================================================= */
+struct DebugChannel *
+EnableDebugChannel(struct ROMController *controller, size_t ringSize,
+  DebugChannelSink sink, void *opaque) {
+  if (controller->debugChannel != NULL)
+    DestroyDebugChannel(controller->debugChannel);
+
+  controller->debugChannel = CreateDebugChannel(ringSize, sink, opaque);
+  SetCartReadHandler(controller);
+  return controller->debugChannel;
+}
+
+/* ============================================================================
+ *  GetROMMemoryUsage: Reports what a controller holds.
+ * ========================================================================= */
+void
+GetROMMemoryUsage(const struct ROMController *controller,
+  struct ROMMemoryUsage *usage) {
+  memset(usage, 0, sizeof(*usage));
+  AddROMMemoryUsage(controller, usage);
+}
+
+/* ============================================================================
+ *  GetAllROMMemoryUsage: Reports what every live controller holds. Must not
+ *  race with calls that change a controller's cart or debug channel.
+ * ========================================================================= */
+void
+GetAllROMMemoryUsage(struct ROMMemoryUsage *usage) {
+  const struct ROMController *controller;
+
+  memset(usage, 0, sizeof(*usage));
+  LockControllers();
+
+  for (controller = Controllers; controller; controller = controller->next)
+    AddROMMemoryUsage(controller, usage);
+
+  UnlockControllers();
+}
+
+/* ============================================================================
+ *  AddROMMemoryUsage: Adds what a controller holds to usage.
+ * ========================================================================= */
+static void
+AddROMMemoryUsage(const struct ROMController *controller,
+  struct ROMMemoryUsage *usage) {
+  usage->controllers++;
+  usage->sram += controller->sramSize;
+  usage->other += sizeof(*controller);
+
+  if (controller->cart != NULL)
+    GetCartMemoryUsage(controller->cart, usage);
+
+  if (controller->debugChannel != NULL)
+    usage->debugChannel += GetDebugChannelSize(controller->debugChannel);
+}
+
 /* ============================================================================
  *  InitROM: Initializes the ROM controller.
  * ========================================================================= */
@@ -87,6 +209,59 @@ static void
 InitROM(struct ROMController *controller) {
   debug("Initializing Interface.");
   memset(controller, 0, sizeof(*controller));
+  SetCartReadHandler(controller);
+}
+
+/* ============================================================================
+ *  InitSRAM: Sizes domain 2 for the inserted cart. Without a cart, it holds
+ *  256Kbit of SRAM; carts that save elsewhere get none. A save file that is
+ *  already open is written back, then read again for the new cart.
+ * ========================================================================= */
+static int
+InitSRAM(struct ROMController *controller) {
+  enum CartSaveType saveType = controller->cart
+    ? controller->cart->saveType : SAVE_TYPE_SRAM;
+  size_t size = 0;
+
+  switch(saveType) {
+    case SAVE_TYPE_SRAM:
+    case SAVE_TYPE_SRAM_768K:
+    case SAVE_TYPE_SRAM_1M:
+      size = GetCartSaveSize(saveType);
+      break;
+
+    default:
+      break;
+  }
+
+  if (controller->sramFile && PIHasSRAM(controller))
+    WriteSRAMFile(controller);
+
+  free(controller->sram);
+  controller->sram = NULL;
+  controller->sramSize = 0;
+
+  if (size > 0) {
+    if ((controller->sram = (uint8_t*) calloc(1, size)) == NULL) {
+      debug("Failed to allocate memory for SRAM.");
+      return 1;
+    }
+
+    controller->sramSize = size;
+  }
+
+  if (controller->sramFile == NULL)
+    return 0;
+
+  if (!PIHasSRAM(controller)) {
+    debug("SRAM: Cart does not use SRAM; closing the save file.");
+    fclose(controller->sramFile);
+    controller->sramFile = NULL;
+    return 0;
+  }
+
+  ReadSRAMFile(controller);
+  return 0;
 }
 
 /* ============================================================================
@@ -99,7 +274,14 @@ InsertCart(struct ROMController *controller, const char *filename) {
   if (controller->cart != NULL)
     DestroyCart(controller->cart);
 
-  if ((controller->cart = CreateCart(filename)) == NULL)
+  controller->cart = controller->cartCacheSize
+    ? CreateCachedCart(filename, controller->cartCacheSize)
+    : CreateCartWithOptions(filename, &controller->loadOptions);
+
+  SetCartReadHandler(controller);
+
+  /* Domain 2 follows the cart, even if it failed to load. */
+  if (InitSRAM(controller) || controller->cart == NULL)
     return 1;
 
 #ifndef NDEBUG
@@ -110,6 +292,77 @@ InsertCart(struct ROMController *controller, const char *filename) {
   return 0;
 }
 
+/* ============================================================================
+ *  InsertSharedCart: Associates a cart published by another process (see
+ *  CartShare.h) with the controller. The caller keeps ownership of fd.
+ * ========================================================================= */
+int
+InsertSharedCart(struct ROMController *controller, int fd) {
+  if (controller->cart != NULL)
+    DestroyCart(controller->cart);
+
+  controller->cart = CreateCartFromFd(fd);
+  SetCartReadHandler(controller);
+
+  if (InitSRAM(controller) || controller->cart == NULL)
+    return 1;
+
+  return 0;
+}
+
+/* ============================================================================
+ *  SetCartCacheSize: Bounds the memory used to hold subsequently inserted
+ *  carts; the image is then read on demand. Zero loads the whole image.
+ * ========================================================================= */
+void
+SetCartCacheSize(struct ROMController *controller, size_t size) {
+  controller->cartCacheSize = size;
+}
+
+/* ============================================================================
+ *  SetCartLoadOptions: Sets how subsequently inserted carts are loaded.
+ * ========================================================================= */
+void
+SetCartLoadOptions(struct ROMController *controller,
+  const struct ROMLoadOptions *options) {
+  controller->loadOptions = *options;
+}
+
+/* ============================================================================
+ *  LockControllers/UnlockControllers: Guard the list of live controllers.
+ *  GetAllROMMemoryUsage holds the lock across system calls, so threads that
+ *  contend for it sleep where the build has pthreads; elsewhere, it spins.
+ * ========================================================================= */
+static void
+LockControllers(void) {
+#ifdef _POSIX_C_SOURCE
+  pthread_mutex_lock(&ControllersLock);
+#else
+  uint32_t expected = 0;
+
+  while (!AtomicCAS32(&ControllersLock, &expected, 1))
+    expected = 0;
+#endif
+}
+
+static void
+UnlockControllers(void) {
+#ifdef _POSIX_C_SOURCE
+  pthread_mutex_unlock(&ControllersLock);
+#else
+  AtomicStore32(&ControllersLock, 0);
+#endif
+}
+
+/* ============================================================================
+ *  PIGetStatus: Returns PI_STATUS_REG; safe to call from any thread. Once
+ *  PI_STATUS_DMA_BUSY reads clear, the DMA's effects are visible.
+ * ========================================================================= */
+uint32_t
+PIGetStatus(const struct ROMController *controller) {
+  return AtomicLoad32(&controller->regs[PI_STATUS_REG]);
+}
+
 /* ============================================================================
  *  PIRegRead: Read from PI registers.
  * ========================================================================= */
@@ -126,7 +379,7 @@ PIRegRead(void *_pif, uint32_t address, void *_data) {
   if (reg == PI_STATUS_REG)
     *data = 0;
   else
-    *data = controller->regs[reg];
+    *data = AtomicLoad32(&controller->regs[reg]);
 
   return 0;
 }
@@ -144,26 +397,7 @@ PIRegWrite(void *_pif, uint32_t address, void *_data) {
 
   debugarg("PIRegWrite: Writing to register [%s].", PIRegisterMnemonics[reg]);
 
-  controller->regs[reg] = *data;
-
-  /* Action? */
-  switch(reg) {
-    case PI_STATUS_REG:
-      PIHandleStatusWrite(controller);
-      break;
-
-    case PI_RD_LEN_REG:
-      PIHandleDMARead(controller);
-      break;
-
-    case PI_WR_LEN_REG:
-      PIHandleDMAWrite(controller);
-      break;
-
-    default:
-      break;
-  }
-
+  PIWriteRegister(controller, reg, *data);
   return 0;
 }
 
@@ -26,18 +26,54 @@ extern const char *PIRegisterMnemonics[NUM_PI_REGISTERS];
 #endif
 
 struct BusController;
+struct DebugChannel;
 
 struct ROMController {
+  struct ROMController *prev, *next;
   struct BusController *bus;
+  uint8_t *rdram;
+  size_t rdramSize;
+
   struct Cart *cart;
   FILE *sramFile;
+  size_t cartCacheSize;
+  struct ROMLoadOptions loadOptions;
+  struct DebugChannel *debugChannel;
+
+  /* Serves CartRead; see SetCartReadHandler. */
+  int (*cartRead)(struct ROMController *, uint32_t, uint32_t *);
+
+  /* Sized for the cart's save type; NULL if it does not use SRAM. */
+  uint8_t *sram;
+  size_t sramSize;
 
   uint32_t regs[NUM_PI_REGISTERS];
-  uint8_t sram[32768];
+};
+
+/* ============================================================================
+ *  ROMMemoryUsage: What a controller (or all of them) holds, in bytes. The
+ *  image may be shared with other instances or processes; romResident is
+ *  how much of it is resident in the page cache, counted in full for each.
+ * ========================================================================= */
+struct ROMMemoryUsage {
+  unsigned controllers;
+
+  size_t romSize;       /* Size of the image. */
+  size_t romMapped;     /* Address space mapped or allocated for it. */
+  size_t romResident;   /* How much of the image is resident. */
+  size_t romDirty;      /* Pages of the image ever written to. */
+
+  size_t sram;          /* SRAM backing store. */
+  size_t cartCache;     /* Block cache for carts inserted with one. */
+  size_t debugChannel;  /* Debug window and ring. */
+  size_t other;         /* Controller and cart bookkeeping. */
 };
 
 struct ROMController *CreateROM(void);
 void DestroyROM(struct ROMController *);
 
+void GetROMMemoryUsage(const struct ROMController *, struct ROMMemoryUsage *);
+void GetAllROMMemoryUsage(struct ROMMemoryUsage *);
+
 #endif
 
@@ -0,0 +1,89 @@
+/* ============================================================================
+ *  DMACopy.c: Size-tiered copy kernels for direct RDRAM transfers.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "Common.h"
+#include "DMACopy.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstring>
+#else
+#include <stddef.h>
+#include <string.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DMA_VECTOR_SIZE 32
+typedef __m256i DMAVector;
+#define DMAVectorLoad(src) _mm256_loadu_si256((const __m256i*) (src))
+#define DMAVectorStream(dest, v) _mm256_stream_si256((__m256i*) (dest), v)
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define DMA_VECTOR_SIZE 16
+typedef __m128i DMAVector;
+#define DMAVectorLoad(src) _mm_loadu_si128((const __m128i*) (src))
+#define DMAVectorStream(dest, v) _mm_stream_si128((__m128i*) (dest), v)
+#endif
+
+#ifdef DMA_VECTOR_SIZE
+static void CopyStream(uint8_t *, const uint8_t *, size_t);
+
+/* ============================================================================
+ *  CopyStream: Copies with non-temporal stores, so that bulk loads do not
+ *  evict the working set of the emulated CPU from the host's caches.
+ * ========================================================================= */
+static void
+CopyStream(uint8_t *dest, const uint8_t *src, size_t length) {
+  size_t head = (DMA_VECTOR_SIZE - ((uintptr_t) dest %
+    DMA_VECTOR_SIZE)) % DMA_VECTOR_SIZE;
+
+  /* Streaming stores must be aligned. */
+  memcpy(dest, src, head);
+  dest += head;
+  src += head;
+  length -= head;
+
+  for (; length >= 4 * DMA_VECTOR_SIZE; length -= 4 * DMA_VECTOR_SIZE) {
+    DMAVector v0 = DMAVectorLoad(src + 0 * DMA_VECTOR_SIZE);
+    DMAVector v1 = DMAVectorLoad(src + 1 * DMA_VECTOR_SIZE);
+    DMAVector v2 = DMAVectorLoad(src + 2 * DMA_VECTOR_SIZE);
+    DMAVector v3 = DMAVectorLoad(src + 3 * DMA_VECTOR_SIZE);
+
+    DMAVectorStream(dest + 0 * DMA_VECTOR_SIZE, v0);
+    DMAVectorStream(dest + 1 * DMA_VECTOR_SIZE, v1);
+    DMAVectorStream(dest + 2 * DMA_VECTOR_SIZE, v2);
+    DMAVectorStream(dest + 3 * DMA_VECTOR_SIZE, v3);
+
+    dest += 4 * DMA_VECTOR_SIZE;
+    src += 4 * DMA_VECTOR_SIZE;
+  }
+
+  _mm_sfence();
+  memcpy(dest, src, length);
+}
+#endif
+
+/* ============================================================================
+ *  DMACopyLarge: The out-of-line tiers of DMACopy. Up to DMA_COPY_STREAM_MIN
+ *  the C library's memcpy is as fast as anything we could write here.
+ * ========================================================================= */
+void
+DMACopyLarge(void *dest, const void *src, size_t length) {
+#ifdef DMA_VECTOR_SIZE
+  if (length >= DMA_COPY_STREAM_MIN) {
+    CopyStream((uint8_t*) dest, (const uint8_t*) src, length);
+    return;
+  }
+#endif
+
+  memcpy(dest, src, length);
+}
@@ -0,0 +1,60 @@
+/* ============================================================================
+ *  DMACopy.h: Size-tiered copy kernels for direct RDRAM transfers.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#ifndef __ROM__DMACOPY_H__
+#define __ROM__DMACOPY_H__
+#include "Common.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstring>
+#else
+#include <stddef.h>
+#include <string.h>
+#endif
+
+/* Transfers at or below this size are done with inline moves. */
+#define DMA_COPY_SMALL_MAX        64
+
+/* Transfers at or above this size bypass the cache on the way out. */
+#define DMA_COPY_STREAM_MIN       0x100000
+
+void DMACopyLarge(void *, const void *, size_t);
+
+/* ============================================================================
+ *  DMACopy: Copies length bytes, picking a kernel based on the size. Small
+ *  copies are done in place, 8 bytes at a time; DMA lengths are nearly
+ *  always a multiple of 8, so the byte tail rarely runs.
+ * ========================================================================= */
+static inline void
+DMACopy(void *dest, const void *src, size_t length) {
+  uint8_t *d = (uint8_t*) dest;
+  const uint8_t *s = (const uint8_t*) src;
+  uint64_t dword;
+
+  if (length > DMA_COPY_SMALL_MAX) {
+    DMACopyLarge(dest, src, length);
+    return;
+  }
+
+  for (; length >= sizeof(dword); length -= sizeof(dword)) {
+    memcpy(&dword, s, sizeof(dword));
+    memcpy(d, &dword, sizeof(dword));
+
+    d += sizeof(dword);
+    s += sizeof(dword);
+  }
+
+  while (length--)
+    *d++ = *s++;
+}
+
+#endif
+
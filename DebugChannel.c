@@ -0,0 +1,328 @@
+/* ============================================================================
+ *  DebugChannel.c: Development cart debug channel.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "Common.h"
+#include "DebugChannel.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#else
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#ifdef DEBUG_CHANNEL_THREAD
+#include <pthread.h>
+#include <time.h>
+#endif
+
+/* Large enough that any single flush of the window always fits. */
+#define DEBUG_RING_MIN_SIZE       0x10000
+#define DEBUG_RING_DEFAULT_SIZE   0x400000
+#define DEBUG_RING_POLL_NS        1000000
+
+/* ============================================================================
+ *  The window is kept in the N64's byte order, so that DMAs and word writes
+ *  land in it the same way. Flushed messages go into a single-producer,
+ *  single-consumer ring: the CPU thread only ever advances head, the drain
+ *  side only ever advances tail, and neither takes a lock. Both indices are
+ *  free-running and kept on separate cache lines.
+ * ========================================================================= */
+struct DebugChannel {
+  uint8_t window[DEBUG_WINDOW_ADDRESS_LEN];
+
+  uint8_t *ring;
+  uint32_t ringMask;
+  uint32_t dropped;
+
+  DebugChannelSink sink;
+  void *opaque;
+
+#ifdef DEBUG_CHANNEL_THREAD
+  pthread_t thread;
+  uint32_t stop;
+  bool threaded;
+#endif
+
+  uint8_t headPad[64];
+  uint32_t head;
+  uint8_t tailPad[64];
+  uint32_t tail;
+};
+
+static size_t DeliverDebugChannel(struct DebugChannel *);
+static void PushDebugChannel(struct DebugChannel *, const uint8_t *, uint32_t);
+
+#ifdef DEBUG_CHANNEL_THREAD
+static void *DrainThread(void *);
+#endif
+
+/* ============================================================================
+ *  CreateDebugChannel: Creates a channel with a ring of at least ringSize
+ *  bytes (zero selects a default). If sink is not NULL, a host thread hands
+ *  everything written to it; otherwise the host polls DrainDebugChannel.
+ *  Builds without DEBUG_CHANNEL_THREAD call the sink on the CPU's thread.
+ * ========================================================================= */
+struct DebugChannel *
+CreateDebugChannel(size_t ringSize, DebugChannelSink sink, void *opaque) {
+  struct DebugChannel *channel;
+  size_t size = DEBUG_RING_MIN_SIZE;
+
+  if (ringSize == 0)
+    ringSize = DEBUG_RING_DEFAULT_SIZE;
+
+  while (size < ringSize && size < 0x80000000U)
+    size <<= 1;
+
+  if ((channel = (struct DebugChannel*) calloc(1, sizeof(*channel))) == NULL) {
+    debug("Failed to allocate memory for the debug channel.");
+    return NULL;
+  }
+
+  if ((channel->ring = (uint8_t*) malloc(size)) == NULL) {
+    debug("Failed to allocate memory for the debug channel.");
+
+    free(channel);
+    return NULL;
+  }
+
+  channel->ringMask = size - 1;
+  channel->sink = sink;
+  channel->opaque = opaque;
+
+#ifdef DEBUG_CHANNEL_THREAD
+  if (sink != NULL) {
+    if (pthread_create(&channel->thread, NULL, DrainThread, channel)) {
+      debug("Failed to start the debug channel thread.");
+
+      free(channel->ring);
+      free(channel);
+      return NULL;
+    }
+
+    channel->threaded = true;
+  }
+#endif
+
+  return channel;
+}
+
+/* ============================================================================
+ *  DestroyDebugChannel: Stops the drain thread (after it has delivered
+ *  anything still pending) and releases the channel.
+ * ========================================================================= */
+void
+DestroyDebugChannel(struct DebugChannel *channel) {
+#ifdef DEBUG_CHANNEL_THREAD
+  if (channel->threaded) {
+    AtomicStore32(&channel->stop, 1);
+    pthread_join(channel->thread, NULL);
+  }
+#endif
+
+  free(channel->ring);
+  free(channel);
+}
+
+/* ============================================================================
+ *  DebugChannelFileSink: A sink that writes to the FILE * passed as opaque.
+ * ========================================================================= */
+void
+DebugChannelFileSink(void *opaque, const void *data, size_t length) {
+  FILE *file = (FILE*) opaque;
+
+  fwrite(data, 1, length, file);
+  fflush(file);
+}
+
+/* ============================================================================
+ *  DebugChannelRead: Reads a word from the window. The first word always
+ *  reads back the magic so that software can probe for the channel.
+ * ========================================================================= */
+uint32_t
+DebugChannelRead(const struct DebugChannel *channel, uint32_t address) {
+  uint32_t offset = (address - DEBUG_WINDOW_BASE_ADDRESS) & ~3U;
+  uint32_t word;
+
+  if (offset == DEBUG_WINDOW_MAGIC)
+    return DEBUG_WINDOW_MAGIC_VALUE;
+
+  memcpy(&word, channel->window + offset, sizeof(word));
+  return ByteOrderSwap32(word);
+}
+
+/* ============================================================================
+ *  DebugChannelWrite: Writes a word to the window. Writing the length
+ *  register flushes that many bytes of the buffer into the ring.
+ * ========================================================================= */
+void
+DebugChannelWrite(struct DebugChannel *channel,
+  uint32_t address, uint32_t word) {
+  uint32_t offset = (address - DEBUG_WINDOW_BASE_ADDRESS) & ~3U;
+
+  if (offset == DEBUG_WINDOW_LENGTH) {
+    if (word > DEBUG_WINDOW_ADDRESS_LEN - DEBUG_WINDOW_BUFFER)
+      word = DEBUG_WINDOW_ADDRESS_LEN - DEBUG_WINDOW_BUFFER;
+
+    PushDebugChannel(channel, channel->window + DEBUG_WINDOW_BUFFER, word);
+    return;
+  }
+
+  word = ByteOrderSwap32(word);
+  memcpy(channel->window + offset, &word, sizeof(word));
+}
+
+/* ============================================================================
+ *  DrainDebugChannel: Copies up to size bytes out of the ring and returns
+ *  the number copied. Only for channels created without a sink.
+ * ========================================================================= */
+size_t
+DrainDebugChannel(struct DebugChannel *channel, void *_dest, size_t size) {
+  uint8_t *dest = (uint8_t*) _dest;
+  uint32_t tail = channel->tail;
+  uint32_t avail = AtomicLoad32(&channel->head) - tail;
+  uint32_t start = tail & channel->ringMask;
+  uint32_t first;
+
+  if (avail > size)
+    avail = size;
+
+  first = channel->ringMask + 1 - start;
+
+  if (first > avail)
+    first = avail;
+
+  memcpy(dest, channel->ring + start, first);
+  memcpy(dest + first, channel->ring, avail - first);
+
+  AtomicStore32(&channel->tail, tail + avail);
+  return avail;
+}
+
+/* ============================================================================
+ *  GetDebugChannelBuffer: Returns a pointer to the window at a bus address,
+ *  for DMAs that target it. avail receives the bytes left in the window.
+ * ========================================================================= */
+uint8_t *
+GetDebugChannelBuffer(struct DebugChannel *channel,
+  uint32_t address, uint32_t *avail) {
+  uint32_t offset = address - DEBUG_WINDOW_BASE_ADDRESS;
+
+  *avail = DEBUG_WINDOW_ADDRESS_LEN - offset;
+  return channel->window + offset;
+}
+
+/* ============================================================================
+ *  GetDebugChannelDropped: Returns the number of bytes discarded because
+ *  the ring was full. The CPU is never made to wait on the host.
+ * ========================================================================= */
+uint32_t
+GetDebugChannelDropped(const struct DebugChannel *channel) {
+  return AtomicLoad32(&channel->dropped);
+}
+
+/* ============================================================================
+ *  GetDebugChannelSize: Returns the memory held by the channel, in bytes.
+ * ========================================================================= */
+size_t
+GetDebugChannelSize(const struct DebugChannel *channel) {
+  return sizeof(*channel) + channel->ringMask + 1;
+}
+
+/* ============================================================================
+ *  DeliverDebugChannel: Hands everything in the ring to the sink in place
+ *  (at most two spans) and returns the number of bytes delivered.
+ * ========================================================================= */
+static size_t
+DeliverDebugChannel(struct DebugChannel *channel) {
+  uint32_t tail = channel->tail;
+  uint32_t avail = AtomicLoad32(&channel->head) - tail;
+  uint32_t start = tail & channel->ringMask;
+  uint32_t first = channel->ringMask + 1 - start;
+
+  if (avail == 0)
+    return 0;
+
+  if (first > avail)
+    first = avail;
+
+  channel->sink(channel->opaque, channel->ring + start, first);
+
+  if (avail > first)
+    channel->sink(channel->opaque, channel->ring, avail - first);
+
+  AtomicStore32(&channel->tail, tail + avail);
+  return avail;
+}
+
+/* ============================================================================
+ *  PushDebugChannel: Appends a message to the ring. Messages are never
+ *  split: if one does not fit, all of it is dropped and counted.
+ * ========================================================================= */
+static void
+PushDebugChannel(struct DebugChannel *channel,
+  const uint8_t *data, uint32_t length) {
+  uint32_t head = channel->head;
+  uint32_t used = head - AtomicLoad32(&channel->tail);
+  uint32_t start = head & channel->ringMask;
+  uint32_t first = channel->ringMask + 1 - start;
+
+  if (length > channel->ringMask + 1 - used) {
+    AtomicAdd32(&channel->dropped, length);
+    return;
+  }
+
+  if (first > length)
+    first = length;
+
+  memcpy(channel->ring + start, data, first);
+  memcpy(channel->ring, data + first, length - first);
+
+  AtomicStore32(&channel->head, head + length);
+
+#ifdef DEBUG_CHANNEL_THREAD
+  if (channel->threaded)
+    return;
+#endif
+
+  if (channel->sink != NULL)
+    DeliverDebugChannel(channel);
+}
+
+#ifdef DEBUG_CHANNEL_THREAD
+/* ============================================================================
+ *  DrainThread: Delivers the ring to the sink until asked to stop, then
+ *  delivers whatever was left behind.
+ * ========================================================================= */
+static void *
+DrainThread(void *opaque) {
+  struct DebugChannel *channel = (struct DebugChannel*) opaque;
+  struct timespec poll = {0, DEBUG_RING_POLL_NS};
+
+  for (;;) {
+    bool stop = AtomicLoad32(&channel->stop);
+
+    while (DeliverDebugChannel(channel) > 0);
+
+    if (stop)
+      break;
+
+    nanosleep(&poll, NULL);
+  }
+
+  return NULL;
+}
+#endif
+
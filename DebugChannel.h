@@ -0,0 +1,55 @@
+/* ============================================================================
+ *  DebugChannel.h: Development cart debug channel.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#ifndef __ROM__DEBUGCHANNEL_H__
+#define __ROM__DEBUGCHANNEL_H__
+#include "Address.h"
+#include "Common.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#else
+#include <stddef.h>
+#endif
+
+/* Offsets within the debug window. */
+#define DEBUG_WINDOW_MAGIC        0x00
+#define DEBUG_WINDOW_LENGTH       0x14
+#define DEBUG_WINDOW_BUFFER       0x20
+
+/* "IS64": lets software probe for the channel. */
+#define DEBUG_WINDOW_MAGIC_VALUE  0x49533634
+
+typedef void (*DebugChannelSink)(void *, const void *, size_t);
+
+struct DebugChannel;
+
+struct DebugChannel *CreateDebugChannel(size_t, DebugChannelSink, void *);
+void DestroyDebugChannel(struct DebugChannel *);
+
+size_t DrainDebugChannel(struct DebugChannel *, void *, size_t);
+uint32_t GetDebugChannelDropped(const struct DebugChannel *);
+size_t GetDebugChannelSize(const struct DebugChannel *);
+void DebugChannelFileSink(void *, const void *, size_t);
+
+uint32_t DebugChannelRead(const struct DebugChannel *, uint32_t);
+void DebugChannelWrite(struct DebugChannel *, uint32_t, uint32_t);
+uint8_t *GetDebugChannelBuffer(struct DebugChannel *, uint32_t, uint32_t *);
+
+/* ============================================================================
+ *  IsDebugWindow: Returns true if a bus address falls in the debug window.
+ * ========================================================================= */
+static inline bool
+IsDebugWindow(uint32_t address) {
+  return address - DEBUG_WINDOW_BASE_ADDRESS < DEBUG_WINDOW_ADDRESS_LEN;
+}
+
+#endif
+
@@ -15,5 +15,15 @@
 /* MI_INTR_REG bits. */
 #define MI_INTR_PI                0x10
 
+/* PI_STATUS_REG bits (read). */
+#define PI_STATUS_DMA_BUSY        0x01
+#define PI_STATUS_IO_BUSY         0x02
+#define PI_STATUS_ERROR           0x04
+#define PI_STATUS_INTERRUPT       0x08
+
+/* PI_STATUS_REG bits (write). */
+#define PI_STATUS_RESET           0x01
+#define PI_STATUS_CLEAR_INTERRUPT 0x02
+
 #endif
 
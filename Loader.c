@@ -0,0 +1,686 @@
+/* ============================================================================
+ *  Loader.c: ROM image loader.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#if defined(PARALLEL_ROM_LOADER) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "Common.h"
+#include "Loader.h"
+
+#ifdef __cplusplus
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#else
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#ifdef PARALLEL_ROM_LOADER
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+struct LoadJob {
+  int fd;
+  bool direct;
+  uint8_t *image;
+  size_t size;
+
+  struct ROMLoadOptions options;
+  pthread_mutex_t progressLock;
+
+  uint32_t numChunks;
+  uint32_t nextChunk;
+  uint32_t loaded;
+  uint32_t failed;
+};
+
+/* ============================================================================
+ *  ROMStream: A load running in the background. Chunks are read in order,
+ *  except that a chunk somebody is waiting on is read next.
+ * ========================================================================= */
+#define ROM_STREAM_NO_CHUNK 0xFFFFFFFFU
+
+struct ROMStream {
+  struct LoadJob job;
+  pthread_t thread;
+  bool threaded;
+
+  pthread_mutex_t lock;
+  pthread_cond_t arrived;
+
+  uint32_t priority;
+  uint32_t stop;
+  uint32_t *ready;
+};
+
+static size_t ChunkLength(const struct LoadJob *, uint32_t, size_t *);
+static bool IsChunkReady(struct ROMStream *, uint32_t);
+static int LoadWithThreads(struct LoadJob *);
+static void *LoadWorker(void *);
+static int OpenJob(struct LoadJob *, const char *, uint8_t *, size_t,
+  const struct ROMLoadOptions *);
+static int ReadChunk(struct LoadJob *, uint32_t);
+static void ReportProgress(struct LoadJob *, size_t);
+static void *StreamWorker(void *);
+
+#ifdef __linux__
+static int LoadWithIOURing(struct LoadJob *);
+#endif
+
+#else
+static int SafeFRead(uint8_t *, size_t, FILE *);
+#endif
+
+/* ============================================================================
+ *  AllocROMImage: Allocates a buffer suitable for LoadROMImage.
+ * ========================================================================= */
+uint8_t *
+AllocROMImage(size_t size) {
+#ifdef PARALLEL_ROM_LOADER
+  size_t allocSize = (size + ROM_LOAD_ALIGNMENT - 1) &
+    ~(size_t) (ROM_LOAD_ALIGNMENT - 1);
+  void *image;
+
+  /* O_DIRECT requires aligned buffers, and may read up to the alignment. */
+  if (posix_memalign(&image, ROM_LOAD_ALIGNMENT, allocSize))
+    return NULL;
+
+  return (uint8_t*) image;
+#else
+  return (uint8_t*) malloc(size);
+#endif
+}
+
+/* ============================================================================
+ *  FreeROMImage: Releases a buffer allocated with AllocROMImage.
+ * ========================================================================= */
+void
+FreeROMImage(uint8_t *image) {
+  free(image);
+}
+
+/* ============================================================================
+ *  LoadROMImage: Reads the first size bytes of a file into image. Returns
+ *  0 on success. The progress callback, if any, may be called from worker
+ *  threads, but calls are never concurrent.
+ * ========================================================================= */
+int
+LoadROMImage(const char *filename, uint8_t *image, size_t size,
+  const struct ROMLoadOptions *options) {
+#ifdef PARALLEL_ROM_LOADER
+  struct LoadJob job;
+  int status;
+
+  if (OpenJob(&job, filename, image, size, options))
+    return -1;
+
+  pthread_mutex_init(&job.progressLock, NULL);
+  status = -1;
+
+#ifdef __linux__
+  status = LoadWithIOURing(&job);
+#endif
+
+  if (status != 0) {
+    debug("io_uring is unavailable; falling back to threads.");
+
+    job.nextChunk = 0;
+    job.loaded = 0;
+    job.failed = 0;
+
+    status = LoadWithThreads(&job);
+  }
+
+  pthread_mutex_destroy(&job.progressLock);
+  close(job.fd);
+  return status;
+#else
+  FILE *file;
+  int status;
+
+  if ((file = fopen(filename, "rb")) == NULL) {
+    debug("Failed to open ROM image.");
+    return -1;
+  }
+
+  status = SafeFRead(image, size, file);
+
+  if (status == 0 && options && options->progress)
+    options->progress(options->opaque, size, size);
+
+  fclose(file);
+  return status;
+#endif
+}
+
+#ifdef PARALLEL_ROM_LOADER
+/* ============================================================================
+ *  StartROMStream: Reads the first chunk of a file into image (enough for
+ *  the header and the boot code), then streams the rest in the background.
+ *  Readers must call WaitROMStream before touching the image.
+ * ========================================================================= */
+struct ROMStream *
+StartROMStream(const char *filename, uint8_t *image, size_t size,
+  const struct ROMLoadOptions *options) {
+  struct ROMStream *stream;
+  uint32_t words;
+
+  if ((stream = (struct ROMStream*) calloc(1, sizeof(*stream))) == NULL)
+    return NULL;
+
+  if (OpenJob(&stream->job, filename, image, size, options)) {
+    free(stream);
+    return NULL;
+  }
+
+  words = (stream->job.numChunks + 31) / 32;
+
+  if ((stream->ready = (uint32_t*) calloc(words, sizeof(uint32_t))) == NULL) {
+    close(stream->job.fd);
+    free(stream);
+    return NULL;
+  }
+
+  pthread_mutex_init(&stream->job.progressLock, NULL);
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->arrived, NULL);
+  stream->priority = ROM_STREAM_NO_CHUNK;
+
+  if (ReadChunk(&stream->job, 0)) {
+    debug("Failed to read the ROM header.");
+
+    FinishROMStream(stream);
+    return NULL;
+  }
+
+  stream->ready[0] = 1;
+
+  if (stream->job.numChunks > 1)
+    stream->threaded = !pthread_create(&stream->thread,
+      NULL, StreamWorker, stream);
+
+  /* Without a thread, just load the rest now. */
+  if (!stream->threaded) {
+    stream->job.nextChunk = 1;
+
+    if (LoadWithThreads(&stream->job)) {
+      FinishROMStream(stream);
+      return NULL;
+    }
+
+    memset(stream->ready, 0xFF, words * sizeof(uint32_t));
+  }
+
+  return stream;
+}
+
+/* ============================================================================
+ *  WaitROMStream: Blocks until a range of the image has been read. Any
+ *  chunk that is still missing is read ahead of the others.
+ * ========================================================================= */
+void
+WaitROMStream(struct ROMStream *stream, size_t offset, size_t length) {
+  uint32_t chunk = offset / ROM_LOAD_CHUNK_SIZE;
+  uint32_t last = (offset + length - 1) / ROM_LOAD_CHUNK_SIZE;
+
+  if (last >= stream->job.numChunks)
+    last = stream->job.numChunks - 1;
+
+  for (; chunk <= last; chunk++) {
+    if (likely(IsChunkReady(stream, chunk)))
+      continue;
+
+    pthread_mutex_lock(&stream->lock);
+    AtomicStore32(&stream->priority, chunk);
+
+    while (!IsChunkReady(stream, chunk))
+      pthread_cond_wait(&stream->arrived, &stream->lock);
+
+    pthread_mutex_unlock(&stream->lock);
+  }
+}
+
+/* ============================================================================
+ *  FinishROMStream: Stops the background load (if it is still running) and
+ *  releases the stream. The image itself belongs to the caller.
+ * ========================================================================= */
+void
+FinishROMStream(struct ROMStream *stream) {
+  AtomicStore32(&stream->stop, 1);
+
+  if (stream->threaded)
+    pthread_join(stream->thread, NULL);
+
+  pthread_cond_destroy(&stream->arrived);
+  pthread_mutex_destroy(&stream->lock);
+  pthread_mutex_destroy(&stream->job.progressLock);
+
+  close(stream->job.fd);
+  free(stream->ready);
+  free(stream);
+}
+#endif
+
+#ifdef PARALLEL_ROM_LOADER
+/* ============================================================================
+ *  ChunkLength: Returns the number of bytes of a chunk that belong to the
+ *  image; length receives how many bytes to request from the file (this is
+ *  rounded up to the alignment for O_DIRECT).
+ * ========================================================================= */
+static size_t
+ChunkLength(const struct LoadJob *job, uint32_t chunk, size_t *length) {
+  size_t offset = (size_t) chunk * ROM_LOAD_CHUNK_SIZE;
+  size_t want = job->size - offset;
+
+  if (want > ROM_LOAD_CHUNK_SIZE)
+    want = ROM_LOAD_CHUNK_SIZE;
+
+  *length = job->direct
+    ? (want + ROM_LOAD_ALIGNMENT - 1) & ~(size_t) (ROM_LOAD_ALIGNMENT - 1)
+    : want;
+
+  return want;
+}
+
+/* ============================================================================
+ *  IsChunkReady: Returns true once a chunk of a stream has been read.
+ * ========================================================================= */
+static bool
+IsChunkReady(struct ROMStream *stream, uint32_t chunk) {
+  return (AtomicLoad32(&stream->ready[chunk / 32]) >> (chunk % 32)) & 1;
+}
+
+/* ============================================================================
+ *  LoadWithThreads: Reads the chunks with a pool of threads doing pread.
+ *  The calling thread takes part, so this works even if no thread starts.
+ * ========================================================================= */
+static int
+LoadWithThreads(struct LoadJob *job) {
+  unsigned numThreads = ROM_LOAD_DEFAULT_THREADS;
+  pthread_t threads[64];
+  unsigned i, started;
+
+  if (job->options.threads)
+    numThreads = job->options.threads;
+
+  if (numThreads > sizeof(threads) / sizeof(*threads))
+    numThreads = sizeof(threads) / sizeof(*threads);
+
+  if (numThreads > job->numChunks)
+    numThreads = job->numChunks;
+
+  for (started = 0; started + 1 < numThreads; started++) {
+    if (pthread_create(threads + started, NULL, LoadWorker, job))
+      break;
+  }
+
+  LoadWorker(job);
+
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  return AtomicLoad32(&job->failed) ? -1 : 0;
+}
+
+/* ============================================================================
+ *  LoadWorker: Claims and reads chunks until none are left.
+ * ========================================================================= */
+static void *
+LoadWorker(void *opaque) {
+  struct LoadJob *job = (struct LoadJob*) opaque;
+  uint32_t chunk;
+
+  while ((chunk = AtomicAdd32(&job->nextChunk, 1)) < job->numChunks) {
+    if (AtomicLoad32(&job->failed))
+      break;
+
+    if (ReadChunk(job, chunk)) {
+      AtomicStore32(&job->failed, 1);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/* ============================================================================
+ *  OpenJob: Prepares to load size bytes of a file into image, falling back
+ *  to buffered reads if the file cannot be opened with O_DIRECT.
+ * ========================================================================= */
+static int
+OpenJob(struct LoadJob *job, const char *filename, uint8_t *image,
+  size_t size, const struct ROMLoadOptions *options) {
+  memset(job, 0, sizeof(*job));
+
+  if (options != NULL)
+    job->options = *options;
+
+  job->direct = job->options.direct;
+  job->image = image;
+  job->size = size;
+  job->numChunks = (size + ROM_LOAD_CHUNK_SIZE - 1) / ROM_LOAD_CHUNK_SIZE;
+
+  if (!job->direct || (job->fd = open(filename, O_RDONLY | O_DIRECT)) == -1) {
+    job->direct = false;
+
+    if ((job->fd = open(filename, O_RDONLY)) == -1) {
+      debug("Failed to open ROM image.");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* ============================================================================
+ *  ReadChunk: Reads one chunk with pread and reports it as loaded.
+ * ========================================================================= */
+static int
+ReadChunk(struct LoadJob *job, uint32_t chunk) {
+  size_t offset = (size_t) chunk * ROM_LOAD_CHUNK_SIZE;
+  size_t length, cur = 0;
+  size_t want = ChunkLength(job, chunk, &length);
+
+  while (cur < want) {
+    ssize_t ret = pread(job->fd, job->image + offset + cur,
+      length - cur, offset + cur);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret <= 0)
+      return -1;
+
+    cur += ret;
+  }
+
+  ReportProgress(job, want);
+  return 0;
+}
+
+/* ============================================================================
+ *  ReportProgress: Accounts for loaded bytes and notifies the host.
+ * ========================================================================= */
+static void
+ReportProgress(struct LoadJob *job, size_t bytes) {
+  AtomicAdd32(&job->loaded, bytes);
+
+  if (job->options.progress) {
+    pthread_mutex_lock(&job->progressLock);
+    job->options.progress(job->options.opaque,
+      AtomicLoad32(&job->loaded), job->size);
+    pthread_mutex_unlock(&job->progressLock);
+  }
+}
+
+/* ============================================================================
+ *  StreamWorker: Reads the chunks of a stream, taking requests from waiting
+ *  readers first. A chunk that cannot be read is left zero-filled, so that
+ *  readers are never stranded.
+ * ========================================================================= */
+static void *
+StreamWorker(void *opaque) {
+  struct ROMStream *stream = (struct ROMStream*) opaque;
+  uint32_t next = 1, chunk;
+
+  while (!AtomicLoad32(&stream->stop)) {
+    chunk = AtomicLoad32(&stream->priority);
+
+    if (chunk == ROM_STREAM_NO_CHUNK || IsChunkReady(stream, chunk)) {
+      while (next < stream->job.numChunks && IsChunkReady(stream, next))
+        next++;
+
+      if (next == stream->job.numChunks)
+        break;
+
+      chunk = next;
+    }
+
+    if (ReadChunk(&stream->job, chunk)) {
+      size_t length, want = ChunkLength(&stream->job, chunk, &length);
+
+      debug("Failed to read part of the ROM image; zero-filling.");
+      memset(stream->job.image + (size_t) chunk * ROM_LOAD_CHUNK_SIZE,
+        0, want);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    AtomicOr32(&stream->ready[chunk / 32], 1U << (chunk % 32));
+    pthread_cond_broadcast(&stream->arrived);
+    pthread_mutex_unlock(&stream->lock);
+  }
+
+  return NULL;
+}
+
+#ifdef __linux__
+/* ============================================================================
+ *  IOURing: The mapped submission and completion queues of an io_uring.
+ * ========================================================================= */
+struct IOURing {
+  int fd;
+
+  struct io_uring_sqe *sqes;
+  uint32_t *sqTail, *sqArray, sqMask;
+
+  struct io_uring_cqe *cqes;
+  uint32_t *cqHead, *cqTail, cqMask;
+};
+
+struct IOURingSlot {
+  uint32_t chunk;
+  size_t done, want, length;
+  struct iovec iov;
+};
+
+/* ============================================================================
+ *  QueueRead: Queues a read of the rest of a slot's chunk at tail.
+ * ========================================================================= */
+static void
+QueueRead(struct IOURing *ring, uint32_t tail, const struct LoadJob *job,
+  struct IOURingSlot *slot, uint32_t id) {
+  struct io_uring_sqe *sqe = ring->sqes + (tail & ring->sqMask);
+  size_t offset = (size_t) slot->chunk * ROM_LOAD_CHUNK_SIZE + slot->done;
+
+  slot->iov.iov_base = job->image + offset;
+  slot->iov.iov_len = slot->length - slot->done;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = job->fd;
+  sqe->off = offset;
+  sqe->addr = (uintptr_t) &slot->iov;
+  sqe->len = 1;
+  sqe->user_data = id;
+
+  ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+}
+
+/* ============================================================================
+ *  RunIOURing: Keeps up to ROM_LOAD_QUEUE_DEPTH reads in flight until every
+ *  chunk has arrived, resubmitting the remainder of short reads. Once a read
+ *  fails, nothing more is submitted, but the reads still in flight target
+ *  the image: they are all reaped before returning, so that the caller may
+ *  reuse the buffer (or hand it to the threaded loader).
+ * ========================================================================= */
+static int
+RunIOURing(struct IOURing *ring, struct LoadJob *job) {
+  struct IOURingSlot slots[ROM_LOAD_QUEUE_DEPTH];
+  uint32_t freeSlots[ROM_LOAD_QUEUE_DEPTH];
+  uint32_t numFree = ROM_LOAD_QUEUE_DEPTH;
+  uint32_t completed = 0, inFlight = 0, toSubmit = 0;
+  uint32_t i, head, tail;
+  long submitted;
+  int status = 0;
+
+  for (i = 0; i < ROM_LOAD_QUEUE_DEPTH; i++)
+    freeSlots[i] = i;
+
+  /* We are the only producer, so the tail is ours to track: resubmissions
+   * queued while reaping below are published on the next pass. */
+  tail = *ring->sqTail;
+
+  while (status == 0 ? completed < job->numChunks : inFlight > 0) {
+    while (status == 0 && numFree > 0 && job->nextChunk < job->numChunks) {
+      uint32_t id = freeSlots[--numFree];
+
+      slots[id].chunk = job->nextChunk++;
+      slots[id].want = ChunkLength(job, slots[id].chunk, &slots[id].length);
+      slots[id].done = 0;
+
+      QueueRead(ring, tail++, job, slots + id, id);
+      toSubmit++;
+    }
+
+    AtomicStore32(ring->sqTail, tail);
+
+    if ((submitted = syscall(__NR_io_uring_enter, ring->fd,
+      status == 0 ? toSubmit : 0, 1, IORING_ENTER_GETEVENTS, NULL, 0)) >= 0) {
+      inFlight += submitted;
+      toSubmit -= submitted;
+    }
+
+    /* If we can no longer wait in the kernel, poll the completion queue:
+     * the reads in flight complete (and post there) regardless. */
+    else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      status = -1;
+      sched_yield();
+    }
+
+    for (head = *ring->cqHead; head != AtomicLoad32(ring->cqTail); head++) {
+      struct io_uring_cqe *cqe = ring->cqes + (head & ring->cqMask);
+      struct IOURingSlot *slot = slots + cqe->user_data;
+
+      inFlight--;
+
+      if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+        cqe->res = 0;
+
+      else if (cqe->res <= 0)
+        status = -1;
+
+      if (status != 0)
+        continue;
+
+      if ((slot->done += cqe->res) < slot->want) {
+        QueueRead(ring, tail++, job, slot, cqe->user_data);
+        toSubmit++;
+        continue;
+      }
+
+      ReportProgress(job, slot->want);
+      freeSlots[numFree++] = cqe->user_data;
+      completed++;
+    }
+
+    AtomicStore32(ring->cqHead, head);
+  }
+
+  return status;
+}
+
+/* ============================================================================
+ *  LoadWithIOURing: Reads the chunks through an io_uring. Returns nonzero if
+ *  the ring could not be set up or a read failed; the caller then retries
+ *  with threads.
+ * ========================================================================= */
+static int
+LoadWithIOURing(struct LoadJob *job) {
+  struct io_uring_params params;
+  struct IOURing ring;
+  size_t sqSize, cqSize, sqesSize;
+  void *sq, *cq, *sqes;
+  int status = -1;
+
+  memset(&params, 0, sizeof(params));
+
+  if ((ring.fd = syscall(__NR_io_uring_setup,
+    ROM_LOAD_QUEUE_DEPTH, &params)) < 0)
+    return -1;
+
+  sqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cqSize = params.cq_off.cqes + params.cq_entries *
+    sizeof(struct io_uring_cqe);
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+
+  sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+
+  cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+    mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+
+  sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+  if (sq != MAP_FAILED && cq != MAP_FAILED && sqes != MAP_FAILED) {
+    ring.sqes = (struct io_uring_sqe*) sqes;
+    ring.sqTail = (uint32_t*) ((uint8_t*) sq + params.sq_off.tail);
+    ring.sqArray = (uint32_t*) ((uint8_t*) sq + params.sq_off.array);
+    ring.sqMask = *(uint32_t*) ((uint8_t*) sq + params.sq_off.ring_mask);
+
+    ring.cqes = (struct io_uring_cqe*) ((uint8_t*) cq + params.cq_off.cqes);
+    ring.cqHead = (uint32_t*) ((uint8_t*) cq + params.cq_off.head);
+    ring.cqTail = (uint32_t*) ((uint8_t*) cq + params.cq_off.tail);
+    ring.cqMask = *(uint32_t*) ((uint8_t*) cq + params.cq_off.ring_mask);
+
+    status = RunIOURing(&ring, job);
+  }
+
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqesSize);
+
+  if (cq != MAP_FAILED && cq != sq)
+    munmap(cq, cqSize);
+
+  if (sq != MAP_FAILED)
+    munmap(sq, sqSize);
+
+  close(ring.fd);
+  return status;
+}
+#endif
+
+#else
+/* ============================================================================
+ *  SafeFRead: Reads size bytes, retrying short reads. Returns 0 on success.
+ * ========================================================================= */
+static int
+SafeFRead(uint8_t *memory, size_t size, FILE *file) {
+  size_t i, read = 0;
+
+  for (i = 0; i < size; i += read) {
+    if ((read = fread(memory + i, 1, size - i, file)) == 0)
+      return 1;
+  }
+
+  return 0;
+}
+#endif
+
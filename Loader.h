@@ -0,0 +1,55 @@
+/* ============================================================================
+ *  Loader.h: ROM image loader.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#ifndef __ROM__LOADER_H__
+#define __ROM__LOADER_H__
+#include "Common.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#else
+#include <stddef.h>
+#endif
+
+/* Images are read in chunks of this size, aligned for O_DIRECT. */
+#define ROM_LOAD_CHUNK_SIZE       0x100000
+#define ROM_LOAD_ALIGNMENT        4096
+#define ROM_LOAD_QUEUE_DEPTH      32
+#define ROM_LOAD_DEFAULT_THREADS  4
+
+typedef void (*ROMLoadProgress)(void *, size_t, size_t);
+
+struct ROMLoadOptions {
+  ROMLoadProgress progress;
+  void *opaque;
+
+  unsigned threads;
+  bool direct;
+  bool progressive;
+
+  /* Let the cart write to its own image (see CartLookupWritable). */
+  bool writable;
+};
+
+struct ROMStream;
+
+uint8_t *AllocROMImage(size_t);
+void FreeROMImage(uint8_t *);
+
+int LoadROMImage(const char *, uint8_t *, size_t,
+  const struct ROMLoadOptions *);
+
+struct ROMStream *StartROMStream(const char *, uint8_t *, size_t,
+  const struct ROMLoadOptions *);
+void WaitROMStream(struct ROMStream *, size_t, size_t);
+void FinishROMStream(struct ROMStream *);
+
+#endif
+
@@ -0,0 +1,114 @@
+/* ============================================================================
+ *  ROMController.hpp: ROM controller, statically bound to a bus.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#ifndef __ROM__ROMCONTROLLER_HPP__
+#define __ROM__ROMCONTROLLER_HPP__
+#include "Actions.h"
+#include "Cart.h"
+#include "Common.h"
+#include "Controller.h"
+#include "Definitions.h"
+
+#include <cstddef>
+
+namespace rom {
+
+/* ============================================================================
+ *  ROMController<Bus>: The PI actions, with every bus access resolved at
+ *  compile time so that it can be inlined into the caller. Bus must provide:
+ *
+ *    void ClearRCPInterrupt(unsigned mask);
+ *    void RaiseRCPInterrupt(unsigned mask);
+ *    void DMAFromDRAM(void *dest, uint32_t source, uint32_t length);
+ *    void DMAToDRAM(uint32_t dest, const void *source, size_t length);
+ *
+ *  The controller state is the same struct used by the C interface, so the
+ *  two may be mixed freely on one instance. If the host registered its RDRAM
+ *  with ConnectROMToRDRAM, the DMA members of Bus are not used.
+ * ========================================================================= */
+template <typename Bus>
+class ROMController {
+public:
+  ROMController(struct ::ROMController &state, Bus &bus)
+    : state(state), bus(bus) {}
+
+  void HandleDMARead();
+  void HandleDMAWrite();
+  void HandleStatusWrite(uint32_t status);
+
+private:
+  struct ::ROMController &state;
+  Bus &bus;
+
+  void FinishDMA(uint32_t length);
+};
+
+/* ============================================================================
+ *  FinishDMA: Completes the DMA (see PIFinishDMA) and raises the interrupt.
+ * ========================================================================= */
+template <typename Bus>
+inline void ROMController<Bus>::FinishDMA(uint32_t length) {
+  PIFinishDMA(&state, length);
+  bus.RaiseRCPInterrupt(MI_INTR_PI);
+}
+
+/* ============================================================================
+ *  HandleDMARead: Invoked when PI_RD_LEN_REG is written.
+ * ========================================================================= */
+template <typename Bus>
+inline void ROMController<Bus>::HandleDMARead() {
+  struct PIDMA dma;
+  uint8_t *data;
+
+  if ((data = PIBeginDMARead(&state, &dma)) != NULL) {
+    if (!PICopyFromRDRAM(&state, data, dma.dram, dma.length))
+      bus.DMAFromDRAM(data, dma.dram, dma.length);
+  }
+
+  FinishDMA(dma.length);
+}
+
+/* ============================================================================
+ *  HandleDMAWrite: Invoked when PI_WR_LEN_REG is written.
+ * ========================================================================= */
+template <typename Bus>
+inline void ROMController<Bus>::HandleDMAWrite() {
+  const uint8_t *data;
+  uint32_t dram, avail;
+  struct PIDMA dma;
+
+  PIBeginDMAWrite(&state, &dma);
+
+  while ((data = PINextDMASpan(&state, &dma, &dram, &avail)) != NULL) {
+    if (!PICopyToRDRAM(&state, dram, data, avail))
+      bus.DMAToDRAM(dram, data, avail);
+  }
+
+  FinishDMA(dma.length);
+}
+
+/* ============================================================================
+ *  HandleStatusWrite: Invoked when PI_STATUS_REG is written.
+ * ========================================================================= */
+template <typename Bus>
+inline void ROMController<Bus>::HandleStatusWrite(uint32_t status) {
+  if (status & PI_STATUS_RESET)
+    AtomicStore32(&state.regs[PI_STATUS_REG], 0);
+
+  if (status & PI_STATUS_CLEAR_INTERRUPT) {
+    bus.ClearRCPInterrupt(MI_INTR_PI);
+    AtomicAnd32(&state.regs[PI_STATUS_REG], ~PI_STATUS_INTERRUPT);
+  }
+}
+
+}
+
+#endif
+
@@ -0,0 +1,175 @@
+/* ============================================================================
+ *  BatchBench.c: PIRegWriteBatch against per-controller PIRegWrite, for
+ *  batches of 64, 256 and 1024 controllers running one cart.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "Address.h"
+#include "Batch.h"
+#include "Bench.h"
+#include "Common.h"
+#include "Definitions.h"
+
+#ifdef __cplusplus
+#include <cstring>
+#else
+#include <string.h>
+#endif
+
+#define BENCH_IMAGE_SIZE          0x4000000
+#define BENCH_RDRAM_SLICE         0x20000
+#define BENCH_DMA_LENGTH          0x10000
+#define BENCH_DMAS                200
+
+/* Each round lands a stride past the last, so that the RDRAM compared at
+ * the end still holds the start of every round's DMA. */
+#define BENCH_DMA_STRIDE          0x100
+#define BENCH_DMA_DEST(round)     (0x1000 + (round) * BENCH_DMA_STRIDE)
+
+static struct BusController Bus;
+
+/* ============================================================================
+ *  RunIndividual/RunBatch: Issue the same sequence of DMAs (set up, start,
+ *  acknowledge) to every controller, and return the time taken.
+ * ========================================================================= */
+static double
+RunIndividual(struct ROMController **controllers, unsigned count,
+  const uint32_t *sources) {
+  double start = BenchNow();
+  unsigned i, j;
+
+  for (i = 0; i < BENCH_DMAS; i++) {
+    for (j = 0; j < count; j++) {
+      uint32_t dram = BENCH_DMA_DEST(i), cart = sources[i];
+      uint32_t length = BENCH_DMA_LENGTH - 1;
+      uint32_t status = PI_STATUS_CLEAR_INTERRUPT;
+
+      PIRegWrite(controllers[j], PI_REGS_BASE_ADDRESS + 4 * PI_DRAM_ADDR_REG,
+        &dram);
+      PIRegWrite(controllers[j], PI_REGS_BASE_ADDRESS + 4 * PI_CART_ADDR_REG,
+        &cart);
+      PIRegWrite(controllers[j], PI_REGS_BASE_ADDRESS + 4 * PI_WR_LEN_REG,
+        &length);
+      PIRegWrite(controllers[j], PI_REGS_BASE_ADDRESS + 4 * PI_STATUS_REG,
+        &status);
+    }
+  }
+
+  return BenchNow() - start;
+}
+
+static double
+RunBatch(struct ROMBatch *batch, const uint32_t *sources) {
+  double start = BenchNow();
+  unsigned i;
+
+  for (i = 0; i < BENCH_DMAS; i++) {
+    struct PIBatchWrite writes[4] = {
+      {PI_DRAM_ADDR_REG, NULL, 0},
+      {PI_CART_ADDR_REG, NULL, 0},
+      {PI_WR_LEN_REG, NULL, BENCH_DMA_LENGTH - 1},
+      {PI_STATUS_REG, NULL, PI_STATUS_CLEAR_INTERRUPT}
+    };
+
+    writes[0].value = BENCH_DMA_DEST(i);
+    writes[1].value = sources[i];
+    PIRegWriteBatch(batch, writes, 4);
+  }
+
+  return BenchNow() - start;
+}
+
+/* ============================================================================
+ *  RunSize: Benchmarks one batch size. Returns nonzero on failure, or if
+ *  the two paths did not leave the same contents in RDRAM.
+ * ========================================================================= */
+static int
+RunSize(const char *path, unsigned count, const uint32_t *sources) {
+  size_t size = (size_t) count * BENCH_RDRAM_SLICE;
+  struct ROMController **controllers;
+  double individual, batched;
+  struct ROMBatch *batch;
+  uint8_t *first, *second;
+  unsigned i;
+  int same;
+
+  controllers = (struct ROMController**) calloc(count, sizeof(*controllers));
+  first = (uint8_t*) calloc(1, size);
+  second = (uint8_t*) calloc(1, size);
+
+  for (i = 0; controllers && i < count; i++) {
+    if ((controllers[i] = CreateROM()) == NULL ||
+      InsertCart(controllers[i], path))
+      break;
+
+    ConnectROMToBus(controllers[i], &Bus);
+  }
+
+  if (!controllers || !first || !second || i < count ||
+    (batch = CreateROMBatch(controllers, count)) == NULL) {
+    for (i = 0; controllers && i < count && controllers[i]; i++)
+      DestroyROM(controllers[i]);
+
+    free(controllers);
+    free(first);
+    free(second);
+    return 1;
+  }
+
+  for (i = 0; i < count; i++)
+    ConnectROMToRDRAM(controllers[i],
+      first + (size_t) i * BENCH_RDRAM_SLICE, BENCH_RDRAM_SLICE);
+
+  individual = RunIndividual(controllers, count, sources);
+
+  for (i = 0; i < count; i++)
+    ConnectROMToRDRAM(controllers[i],
+      second + (size_t) i * BENCH_RDRAM_SLICE, BENCH_RDRAM_SLICE);
+
+  batched = RunBatch(batch, sources);
+  same = memcmp(first, second, size) == 0;
+
+  printf("%-6u %14.1f %14.1f %7.2fx %s\n", count, individual * 1e3,
+    batched * 1e3, individual / batched, same ? "" : "(MISMATCH)");
+
+  DestroyROMBatch(batch);
+
+  for (i = 0; i < count; i++)
+    DestroyROM(controllers[i]);
+
+  free(controllers);
+  free(first);
+  free(second);
+  return !same;
+}
+
+int
+main(void) {
+  static const unsigned counts[] = {64, 256, 1024};
+  uint32_t sources[BENCH_DMAS], seed = 0x6A09E667;
+  char path[32];
+  unsigned i;
+  int failed = 0;
+
+  if (CreateBenchImage(path, BENCH_IMAGE_SIZE, "SM"))
+    return 1;
+
+  for (i = 0; i < BENCH_DMAS; i++) {
+    sources[i] = ROM_CART_BASE_ADDRESS +
+      (BenchRandom(&seed) % (BENCH_IMAGE_SIZE - BENCH_DMA_LENGTH) & ~7U);
+  }
+
+  printf("%-6s %14s %14s %8s\n", "count", "individual ms", "batch ms",
+    "speedup");
+
+  for (i = 0; i < sizeof(counts) / sizeof(*counts); i++)
+    failed |= RunSize(path, counts[i], sources);
+
+  unlink(path);
+  return failed;
+}
@@ -0,0 +1,116 @@
+/* ============================================================================
+ *  Bench.h: Shared scaffolding for the benchmarks.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#ifndef __ROM__BENCH_H__
+#define __ROM__BENCH_H__
+#include "Common.h"
+#include "Controller.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#else
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#endif
+
+#include <unistd.h>
+
+#define BENCH_RDRAM_SIZE          0x800000
+
+/* ============================================================================
+ *  The stand-in for the host's bus: plain RDRAM, with the externs in
+ *  BenchBus.c copying into it out of line, as a real host would.
+ * ========================================================================= */
+struct BusController {
+  uint8_t rdram[BENCH_RDRAM_SIZE];
+  unsigned interrupts;
+};
+
+/* Host-facing entry points; hosts declare these themselves. */
+void ConnectROMToBus(struct ROMController *, struct BusController *);
+void ConnectROMToRDRAM(struct ROMController *, void *, size_t);
+int InsertCart(struct ROMController *, const char *);
+int InsertSharedCart(struct ROMController *, int);
+void SetCartLoadOptions(struct ROMController *,
+  const struct ROMLoadOptions *);
+int PIRegWrite(void *, uint32_t, void *);
+
+/* ============================================================================
+ *  BenchNow: Returns a monotonic timestamp, in seconds.
+ * ========================================================================= */
+static inline double
+BenchNow(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* ============================================================================
+ *  BenchRandom: A xorshift generator, so that runs are repeatable.
+ * ========================================================================= */
+static inline uint32_t
+BenchRandom(uint32_t *state) {
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+/* ============================================================================
+ *  CreateBenchImage: Writes a size byte image with the given game code to
+ *  a temporary file and stores its name in path (at least 32 bytes). The
+ *  caller unlinks it. Returns nonzero on failure.
+ * ========================================================================= */
+static inline int
+CreateBenchImage(char *path, size_t size, const char *id) {
+  static const uint8_t magic[4] = {0x80, 0x37, 0x12, 0x40};
+  uint8_t block[0x10000];
+  uint32_t seed = 0x2545F491;
+  size_t i, done;
+  FILE *file;
+  int fd;
+
+  snprintf(path, 32, "/tmp/romsim-bench-XXXXXX");
+
+  if ((fd = mkstemp(path)) < 0 || (file = fdopen(fd, "wb")) == NULL) {
+    perror("CreateBenchImage");
+    return 1;
+  }
+
+  for (done = 0; done < size; done += sizeof(block)) {
+    for (i = 0; i < sizeof(block); i++)
+      block[i] = (uint8_t) BenchRandom(&seed);
+
+    if (done == 0) {
+      memcpy(block, magic, sizeof(magic));
+      block[0x3C] = id[0];
+      block[0x3D] = id[1];
+    }
+
+    if (fwrite(block, 1, size - done < sizeof(block)
+      ? size - done : sizeof(block), file) == 0)
+      break;
+  }
+
+  fclose(file);
+  return done < size;
+}
+
+#endif
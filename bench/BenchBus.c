@@ -0,0 +1,49 @@
+/* ============================================================================
+ *  BenchBus.c: Bus externs for the benchmarks (see Bench.h).
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "Bench.h"
+#include "Common.h"
+#include "Externs.h"
+
+#ifdef __cplusplus
+#include <cstring>
+#else
+#include <string.h>
+#endif
+
+void
+BusClearRCPInterrupt(struct BusController *bus, unsigned mask) {
+  bus->interrupts &= ~mask;
+}
+
+void
+BusRaiseRCPInterrupt(struct BusController *bus, unsigned mask) {
+  bus->interrupts |= mask;
+}
+
+void
+BusWriteWord(const struct BusController *bus, uint32_t address,
+  uint32_t word) {
+  (void) bus;
+  (void) address;
+  (void) word;
+}
+
+void
+DMAFromDRAM(struct BusController *bus, void *dest,
+  uint32_t source, uint32_t length) {
+  memcpy(dest, bus->rdram + source, length);
+}
+
+void
+DMAToDRAM(struct BusController *bus, uint32_t dest,
+  const void *source, size_t length) {
+  memcpy(bus->rdram + dest, source, length);
+}
@@ -0,0 +1,104 @@
+/* ============================================================================
+ *  DMACopyBench.c: DMACopy throughput in each of its tiers, next to memcpy,
+ *  for rechecking DMA_COPY_SMALL_MAX and DMA_COPY_STREAM_MIN.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "Bench.h"
+#include "Common.h"
+#include "DMACopy.h"
+
+#ifdef __cplusplus
+#include <cstring>
+#else
+#include <string.h>
+#endif
+
+/* Larger than any last-level cache, so that streaming copies miss. */
+#define BENCH_BUFFER_SIZE         0x4000000
+#define BENCH_BYTES               0x10000000
+
+typedef void (*CopyFunction)(void *, const void *, size_t);
+
+/* ============================================================================
+ *  RunCopy: Returns the throughput of copy at a given size, in GB/s. The
+ *  destination walks the buffer, as consecutive DMAs into RDRAM would.
+ * ========================================================================= */
+static double
+RunCopy(CopyFunction copy, uint8_t *dest, const uint8_t *source, size_t size) {
+  size_t count = BENCH_BYTES / size;
+  size_t offset = 0, i;
+  double start;
+
+  start = BenchNow();
+
+  for (i = 0; i < count; i++) {
+    copy(dest + offset, source + (offset & 0xFFFF), size);
+
+    if ((offset += (size + 7) & ~(size_t) 7) > BENCH_BUFFER_SIZE - size)
+      offset = 0;
+  }
+
+  return BENCH_BYTES / (BenchNow() - start) / 1e9;
+}
+
+/* ============================================================================
+ *  Copy: DMACopy, through a call, so that it is measured as memcpy is.
+ * ========================================================================= */
+static void
+Copy(void *dest, const void *source, size_t size) {
+  DMACopy(dest, source, size);
+}
+
+/* ============================================================================
+ *  MemCopy: memcpy, through a call, as the baseline.
+ * ========================================================================= */
+static void
+MemCopy(void *dest, const void *source, size_t size) {
+  memcpy(dest, source, size);
+}
+
+int
+main(void) {
+  static const size_t sizes[] = {
+    8, 32, DMA_COPY_SMALL_MAX,
+    DMA_COPY_SMALL_MAX + 8, 512, 4096, 65536, DMA_COPY_STREAM_MIN / 2,
+    DMA_COPY_STREAM_MIN, 4 * DMA_COPY_STREAM_MIN
+  };
+
+  uint8_t *dest, *source;
+  unsigned i;
+
+  dest = (uint8_t*) malloc(BENCH_BUFFER_SIZE);
+  source = (uint8_t*) malloc(BENCH_BUFFER_SIZE);
+
+  if (dest == NULL || source == NULL) {
+    free(dest);
+    free(source);
+    return 1;
+  }
+
+  memset(dest, 0, BENCH_BUFFER_SIZE);
+  memset(source, 0x5A, BENCH_BUFFER_SIZE);
+
+  printf("%-8s %10s %14s %14s\n", "tier", "size",
+    "DMACopy GB/s", "memcpy GB/s");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+    const char *tier = sizes[i] <= DMA_COPY_SMALL_MAX ? "small"
+      : sizes[i] < DMA_COPY_STREAM_MIN ? "memcpy" : "stream";
+
+    printf("%-8s %10lu %14.2f %14.2f\n", tier, (unsigned long) sizes[i],
+      RunCopy(Copy, dest, source, sizes[i]),
+      RunCopy(MemCopy, dest, source, sizes[i]));
+  }
+
+  free(dest);
+  free(source);
+  return 0;
+}
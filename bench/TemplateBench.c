@@ -0,0 +1,159 @@
+/* ============================================================================
+ *  TemplateBench.c: rom::ROMController<Bus> against the extern-call path.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "Bench.h"
+#include "Common.h"
+
+#ifdef __cplusplus
+#include "Actions.h"
+#include "ROMController.hpp"
+#include <cstring>
+
+#define BENCH_IMAGE_SIZE          0x1000000
+#define BENCH_ITERATIONS          0x100000
+#define BENCH_PASSES              5
+
+/* Small enough to stay in cache, so that the call overhead shows. */
+#define BENCH_WORKING_SET         0x40000
+
+static struct BusController Bus;
+
+/* ============================================================================
+ *  InlineBus: The same RDRAM as BenchBus.c, but visible to the compiler.
+ * ========================================================================= */
+struct InlineBus {
+  struct BusController *bus;
+
+  explicit InlineBus(struct BusController *bus) : bus(bus) {}
+
+  void ClearRCPInterrupt(unsigned mask) {
+    bus->interrupts &= ~mask;
+  }
+
+  void RaiseRCPInterrupt(unsigned mask) {
+    bus->interrupts |= mask;
+  }
+
+  void DMAFromDRAM(void *dest, uint32_t source, uint32_t length) {
+    std::memcpy(dest, bus->rdram + source, length);
+  }
+
+  void DMAToDRAM(uint32_t dest, const void *source, size_t length) {
+    std::memcpy(bus->rdram + dest, source, length);
+  }
+};
+
+/* ============================================================================
+ *  SetupDMA: Points the controller at the next cart to DRAM transfer.
+ * ========================================================================= */
+static inline void
+SetupDMA(struct ROMController *controller, uint32_t *seed, uint32_t length) {
+  uint32_t source = BenchRandom(seed) % (BENCH_WORKING_SET - length) & ~7U;
+  uint32_t dest = BenchRandom(seed) % (BENCH_WORKING_SET - length) & ~7U;
+
+  AtomicStore32(&controller->regs[PI_DRAM_ADDR_REG], dest);
+  AtomicStore32(&controller->regs[PI_CART_ADDR_REG],
+    ROM_CART_BASE_ADDRESS + source);
+  AtomicStore32(&controller->regs[PI_WR_LEN_REG], length - 1);
+}
+
+/* ============================================================================
+ *  RunExtern/RunTemplate: Time BENCH_ITERATIONS DMAs of length bytes.
+ * ========================================================================= */
+static double
+RunExtern(struct ROMController *controller, uint32_t length) {
+  uint32_t seed = 0x9E3779B9;
+  double start = BenchNow();
+  unsigned i;
+
+  for (i = 0; i < BENCH_ITERATIONS; i++) {
+    SetupDMA(controller, &seed, length);
+    PIHandleDMAWrite(controller);
+  }
+
+  return BenchNow() - start;
+}
+
+static double
+RunTemplate(struct ROMController *controller, uint32_t length) {
+  uint32_t seed = 0x9E3779B9;
+  double start = BenchNow();
+  InlineBus bus(&Bus);
+  unsigned i;
+
+  for (i = 0; i < BENCH_ITERATIONS; i++) {
+    SetupDMA(controller, &seed, length);
+    rom::ROMController<InlineBus>(*controller, bus).HandleDMAWrite();
+  }
+
+  return BenchNow() - start;
+}
+
+int
+main(void) {
+  static const uint32_t lengths[] = {8, 64, 512, 4096};
+  struct ROMController *controller;
+  char path[32];
+  unsigned i;
+
+  if (CreateBenchImage(path, BENCH_IMAGE_SIZE, "BK"))
+    return 1;
+
+  if ((controller = CreateROM()) == NULL) {
+    unlink(path);
+    return 1;
+  }
+
+  ConnectROMToBus(controller, &Bus);
+
+  if (InsertCart(controller, path)) {
+    DestroyROM(controller);
+    unlink(path);
+    return 1;
+  }
+
+  printf("%-8s %14s %14s %8s\n", "length", "extern ns/dma",
+    "template ns/dma", "speedup");
+
+  for (i = 0; i < sizeof(lengths) / sizeof(*lengths); i++) {
+    double externTime = 1e9, templateTime = 1e9;
+    unsigned pass;
+
+    /* Interleave the two, and keep the best pass of each. */
+    for (pass = 0; pass < BENCH_PASSES; pass++) {
+      double time;
+
+      if ((time = RunExtern(controller, lengths[i])) < externTime)
+        externTime = time;
+
+      if ((time = RunTemplate(controller, lengths[i])) < templateTime)
+        templateTime = time;
+    }
+
+    printf("%-8u %14.1f %14.1f %7.2fx\n", lengths[i],
+      externTime * 1e9 / BENCH_ITERATIONS,
+      templateTime * 1e9 / BENCH_ITERATIONS,
+      externTime / templateTime);
+  }
+
+  DestroyROM(controller);
+  unlink(path);
+  return 0;
+}
+
+#else
+int
+main(void) {
+  printf("TemplateBench: rom::ROMController needs a C++ build; "
+    "run 'make bench-cpp'.\n");
+
+  return 0;
+}
+#endif
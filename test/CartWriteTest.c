@@ -0,0 +1,219 @@
+/* ============================================================================
+ *  CartWriteTest.c: Checks that a writable cart takes word writes and DMAs
+ *  into its image without touching the file, and that FlushCartWrites and
+ *  LoadCartWrites carry those writes over to a freshly inserted cart.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "../bench/Bench.h"
+#include "Address.h"
+#include "Cart.h"
+#include "Common.h"
+
+#define TEST_IMAGE_SIZE           0x400000
+#define TEST_WORD_OFFSET          0x200000
+#define TEST_DMA_OFFSET           0x300000
+#define TEST_DMA_LENGTH           0x40
+
+/* Two pages are written: one by CartWrite, one by the DMA. */
+#define TEST_SIDECAR_SIZE         (2 * (8 + CART_PAGE_SIZE))
+
+int CartRead(void *, uint32_t, void *);
+int CartWrite(void *, uint32_t, void *);
+
+static struct BusController Bus;
+static unsigned Failures;
+
+/* ============================================================================
+ *  Check: Reports a failed expectation.
+ * ========================================================================= */
+static void
+Check(bool passed, const char *what) {
+  if (!passed) {
+    printf("CartWriteTest: %s.\n", what);
+    Failures++;
+  }
+}
+
+/* ============================================================================
+ *  InsertWritableCart: Creates a controller holding a writable copy of the
+ *  image at path, or returns NULL.
+ * ========================================================================= */
+static struct ROMController *
+InsertWritableCart(const char *path) {
+  struct ROMController *controller;
+  struct ROMLoadOptions options;
+
+  memset(&options, 0, sizeof(options));
+  options.writable = true;
+
+  if ((controller = CreateROM()) == NULL)
+    return NULL;
+
+  ConnectROMToBus(controller, &Bus);
+  SetCartLoadOptions(controller, &options);
+
+  if (InsertCart(controller, path) || !controller->cart->writable) {
+    DestroyROM(controller);
+    return NULL;
+  }
+
+  return controller;
+}
+
+/* ============================================================================
+ *  DMA: Starts a DMA between RDRAM and the cart at offset; read is true for
+ *  a transfer into the cart (PI_RD_LEN_REG).
+ * ========================================================================= */
+static void
+DMA(struct ROMController *controller, uint32_t dram,
+  uint32_t offset, uint32_t length, bool read) {
+  uint32_t cart = ROM_CART_BASE_ADDRESS + offset;
+  enum PIRegister reg = read ? PI_RD_LEN_REG : PI_WR_LEN_REG;
+
+  length -= 1;
+
+  PIRegWrite(controller, PI_REGS_BASE_ADDRESS + 4 * PI_DRAM_ADDR_REG, &dram);
+  PIRegWrite(controller, PI_REGS_BASE_ADDRESS + 4 * PI_CART_ADDR_REG, &cart);
+  PIRegWrite(controller, PI_REGS_BASE_ADDRESS + 4 * reg, &length);
+}
+
+/* ============================================================================
+ *  HoldsWrites: Returns true if the cart reads back both test writes.
+ * ========================================================================= */
+static bool
+HoldsWrites(struct ROMController *controller, const uint8_t *pattern) {
+  uint32_t word;
+
+  CartRead(controller, ROM_CART_BASE_ADDRESS + TEST_WORD_OFFSET, &word);
+  memset(Bus.rdram + 0x1000, 0, TEST_DMA_LENGTH);
+  DMA(controller, 0x1000, TEST_DMA_OFFSET, TEST_DMA_LENGTH, false);
+
+  return word == 0xDEADBEEF &&
+    memcmp(Bus.rdram + 0x1000, pattern, TEST_DMA_LENGTH) == 0;
+}
+
+/* ============================================================================
+ *  FileSize: Returns the size of a file, or -1.
+ * ========================================================================= */
+static long
+FileSize(const char *path) {
+  FILE *file;
+  long size;
+
+  if ((file = fopen(path, "rb")) == NULL)
+    return -1;
+
+  size = fseek(file, 0, SEEK_END) ? -1 : ftell(file);
+  fclose(file);
+  return size;
+}
+
+/* ============================================================================
+ *  AppendRecord: Appends a record header (and no data) to a sidecar file.
+ * ========================================================================= */
+static bool
+AppendRecord(const char *path, uint32_t offset, uint32_t length) {
+  uint32_t header[2];
+  FILE *file;
+  bool written;
+
+  header[0] = ByteOrderSwap32(offset);
+  header[1] = ByteOrderSwap32(length);
+
+  if ((file = fopen(path, "ab")) == NULL)
+    return false;
+
+  written = fwrite(header, sizeof(header), 1, file) == 1;
+  return fclose(file) == 0 && written;
+}
+
+int
+main(void) {
+  struct ROMController *writer, *reader;
+  uint8_t pattern[TEST_DMA_LENGTH];
+  uint32_t word, original;
+  char path[32], sidecar[48];
+  unsigned i;
+
+  if (CreateBenchImage(path, TEST_IMAGE_SIZE, "SM"))
+    return 1;
+
+  snprintf(sidecar, sizeof(sidecar), "%s.writes", path);
+
+  for (i = 0; i < sizeof(pattern); i++)
+    pattern[i] = (uint8_t) (i * 37 + 11);
+
+  if ((writer = InsertWritableCart(path)) == NULL) {
+    printf("CartWriteTest: failed to insert a writable cart.\n");
+    unlink(path);
+    return 1;
+  }
+
+  CartRead(writer, ROM_CART_BASE_ADDRESS + TEST_WORD_OFFSET, &original);
+
+  /* Write a word, and DMA a pattern in from RDRAM. */
+  word = 0xDEADBEEF;
+  CartWrite(writer, ROM_CART_BASE_ADDRESS + TEST_WORD_OFFSET, &word);
+  memcpy(Bus.rdram + 0x100, pattern, sizeof(pattern));
+  DMA(writer, 0x100, TEST_DMA_OFFSET, TEST_DMA_LENGTH, true);
+
+  Check(HoldsWrites(writer, pattern), "the cart lost a write");
+
+  /* A second flush replaces the first rather than adding to it. */
+  Check(FlushCartWrites(writer, sidecar) == 0, "the first flush failed");
+  CartWrite(writer, ROM_CART_BASE_ADDRESS + TEST_WORD_OFFSET, &word);
+  Check(FlushCartWrites(writer, sidecar) == 0, "the second flush failed");
+  Check(FileSize(sidecar) == TEST_SIDECAR_SIZE,
+    "the sidecar does not hold exactly the written pages");
+
+  DestroyROM(writer);
+
+  /* The writes survive into a fresh cart, but never reach the file. */
+  if ((reader = InsertWritableCart(path)) == NULL) {
+    printf("CartWriteTest: failed to insert a writable cart.\n");
+    unlink(sidecar);
+    unlink(path);
+    return 1;
+  }
+
+  CartRead(reader, ROM_CART_BASE_ADDRESS + TEST_WORD_OFFSET, &word);
+  Check(word == original, "the image file was written to");
+
+  Check(LoadCartWrites(reader, sidecar) == 0, "the sidecar did not load");
+  Check(HoldsWrites(reader, pattern), "the sidecar lost a write");
+  DestroyROM(reader);
+
+  /* Zero-length records are accepted. */
+  reader = InsertWritableCart(path);
+
+  Check(reader != NULL && AppendRecord(sidecar, 0, 0) &&
+    LoadCartWrites(reader, sidecar) == 0,
+    "a zero-length record was refused");
+
+  DestroyROM(reader);
+
+  /* A truncated record is refused, before anything is applied. */
+  reader = InsertWritableCart(path);
+
+  Check(reader != NULL && AppendRecord(sidecar, 0, CART_PAGE_SIZE) &&
+    LoadCartWrites(reader, sidecar) != 0,
+    "a truncated record was accepted");
+
+  if (reader != NULL) {
+    CartRead(reader, ROM_CART_BASE_ADDRESS + TEST_WORD_OFFSET, &word);
+    Check(word == original, "a malformed sidecar was partly applied");
+    DestroyROM(reader);
+  }
+
+  unlink(sidecar);
+  unlink(path);
+
+  printf("CartWriteTest: %s.\n", Failures ? "FAILED" : "ok");
+  return Failures != 0;
+}
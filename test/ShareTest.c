@@ -0,0 +1,239 @@
+/* ============================================================================
+ *  ShareTest.c: Checks that processes attached to one published image share
+ *  its pages: each child reports RSS and PSS from /proc/self/smaps_rollup,
+ *  and the test fails unless most of the image is accounted as shared.
+ *
+ *  ROMSIM: ROM device SIMulator.
+ *  Copyright (C) 2013, Tyler J. Stachecki.
+ *  All rights reserved.
+ *
+ *  This file is subject to the terms and conditions defined in
+ *  file 'LICENSE', which is part of this source code package.
+ * ========================================================================= */
+#include "../bench/Bench.h"
+#include "Address.h"
+#include "Cart.h"
+#include "CartShare.h"
+#include "Common.h"
+
+#if defined(SHARED_ROM_IMAGE) && defined(__linux__)
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define TEST_IMAGE_SIZE           0x4000000
+#define TEST_DEFAULT_CHILDREN     8
+
+int CartRead(void *, uint32_t, void *);
+
+/* ============================================================================
+ *  ReadRollup: Returns a field of /proc/self/smaps_rollup, in KiB, or -1.
+ * ========================================================================= */
+static long
+ReadRollup(const char *field) {
+  size_t length = strlen(field);
+  char line[256];
+  long value = -1;
+  FILE *file;
+
+  if ((file = fopen("/proc/self/smaps_rollup", "r")) == NULL)
+    return -1;
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, field, length) == 0) {
+      value = atol(line + length);
+      break;
+    }
+  }
+
+  fclose(file);
+  return value;
+}
+
+/* ============================================================================
+ *  SumCart: Reads every word of the first size bytes of the cart.
+ * ========================================================================= */
+static uint32_t
+SumCart(struct ROMController *controller, uint32_t size) {
+  uint32_t offset, sum = 0, word;
+
+  for (offset = 0; offset < size; offset += 4) {
+    CartRead(controller, ROM_CART_BASE_ADDRESS + offset, &word);
+    sum += word;
+  }
+
+  return sum;
+}
+
+/* ============================================================================
+ *  Rendezvous: Tells the parent this child is ready, then waits until the
+ *  parent says every child is (see ReleaseChildren).
+ * ========================================================================= */
+static bool
+Rendezvous(int socket) {
+  char byte = 0;
+
+  return write(socket, &byte, 1) == 1 && read(socket, &byte, 1) == 1;
+}
+
+/* ============================================================================
+ *  ReleaseChildren: Waits for every child to reach Rendezvous (or exit),
+ *  then lets them all continue. Returns how many arrived.
+ * ========================================================================= */
+static unsigned
+ReleaseChildren(const int *sockets, unsigned children) {
+  unsigned arrived = 0, i;
+  char byte = 0;
+
+  for (i = 0; i < children; i++)
+    arrived += read(sockets[i], &byte, 1) == 1;
+
+  /* Children that failed are gone; do not die of SIGPIPE on their behalf. */
+  for (i = 0; i < children; i++)
+    send(sockets[i], &byte, 1, MSG_NOSIGNAL);
+
+  return arrived;
+}
+
+/* ============================================================================
+ *  RunChild: Attaches to the image sent over socket, checks its contents,
+ *  waits for every sibling to do the same, then measures. Exits nonzero if
+ *  the image could not be used or was not shared.
+ * ========================================================================= */
+static void
+RunChild(int index, int socket, uint32_t expected, unsigned children) {
+  struct ROMController *controller;
+  long rss, pss, shared;
+  int fd;
+
+  if ((fd = ReceiveCartImage(socket)) < 0 ||
+    (controller = CreateROM()) == NULL ||
+    InsertSharedCart(controller, fd)) {
+    printf("child %d: failed to attach to the image.\n", index);
+    fflush(stdout);
+    _exit(1);
+  }
+
+  close(fd);
+
+  if (SumCart(controller, TEST_IMAGE_SIZE) != expected) {
+    printf("child %d: image contents differ.\n", index);
+    fflush(stdout);
+    _exit(1);
+  }
+
+  if (!Rendezvous(socket))
+    _exit(1);
+
+  rss = ReadRollup("Rss:");
+  pss = ReadRollup("Pss:");
+  printf("child %d: rss %ld KiB, pss %ld KiB\n", index, rss, pss);
+  fflush(stdout);
+
+  /* Stay attached until every sibling has measured, too. */
+  if (!Rendezvous(socket))
+    _exit(1);
+
+  DestroyROM(controller);
+
+  /* Each child should only be charged its share of the image. */
+  shared = (long) (TEST_IMAGE_SIZE / 1024) * (children - 1) / children;
+  _exit(rss >= 0 && rss - pss < shared / 2);
+}
+
+int
+main(int argc, char **argv) {
+  unsigned children = argc > 1 ? (unsigned) atoi(argv[1])
+    : TEST_DEFAULT_CHILDREN;
+
+  struct ROMController *controller;
+  int sockets[2], fd, status, unsealed;
+  int *parent;
+  char path[32];
+  uint32_t expected;
+  unsigned i, failed = 0;
+  pid_t *pids;
+
+  if (children < 2 || CreateBenchImage(path, TEST_IMAGE_SIZE, "SM"))
+    return 1;
+
+  parent = (int*) calloc(children, sizeof(*parent));
+  pids = (pid_t*) calloc(children, sizeof(*pids));
+  controller = CreateROM();
+
+  if (parent == NULL || pids == NULL || controller == NULL ||
+    InsertCart(controller, path)) {
+    unlink(path);
+    return 1;
+  }
+
+  expected = SumCart(controller, TEST_IMAGE_SIZE);
+
+  if ((fd = PublishCartImage(controller->cart)) < 0) {
+    printf("ShareTest: failed to publish the image.\n");
+    unlink(path);
+    return 1;
+  }
+
+  /* A plain file carries no seals, so it must be refused. */
+  if ((unsealed = open(path, O_RDONLY)) < 0 ||
+    InsertSharedCart(controller, unsealed) == 0) {
+    printf("ShareTest: attached to an unsealed image.\n");
+    failed++;
+  }
+
+  close(unsealed);
+  unlink(path);
+  DestroyROM(controller);
+
+  if (pwrite(fd, "", 1, 0) != -1) {
+    printf("ShareTest: the published image is writable.\n");
+    failed++;
+  }
+
+  for (i = 0; i < children; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets))
+      return 1;
+
+    if ((pids[i] = fork()) == 0) {
+      close(sockets[0]);
+      close(fd);
+      RunChild(i, sockets[1], expected, children);
+    }
+
+    close(sockets[1]);
+    parent[i] = sockets[0];
+
+    if (pids[i] < 0 || SendCartImage(parent[i], fd))
+      return 1;
+  }
+
+  /* Measure only while every child holds the image. */
+  if (ReleaseChildren(parent, children) < children)
+    printf("ShareTest: not every child attached to the image.\n");
+
+  ReleaseChildren(parent, children);
+
+  for (i = 0; i < children; i++) {
+    if (waitpid(pids[i], &status, 0) < 0 ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed++;
+
+    close(parent[i]);
+  }
+
+  close(fd);
+  free(parent);
+  free(pids);
+
+  printf("ShareTest: %s (%u children).\n", failed ? "FAILED" : "ok", children);
+  return failed != 0;
+}
+
+#else
+int
+main(void) {
+  printf("ShareTest: shared carts need Linux and SHARED_ROM_IMAGE.\n");
+  return 0;
+}
+#endif